@@ -0,0 +1,23 @@
+/*
+ * affinity.h - CPU pinning and NUMA node lookup
+ *
+ * Kept apart from csapp.h because sched_setaffinity and the CPU_SET
+ * macros need _GNU_SOURCE. Memory follows the kernel's default local
+ * policy: pages land on the node of the thread that first touches them,
+ * so a thread that pins itself before allocating gets node-local memory.
+ */
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#define CPU_LIST_MAX 1024 /* cpus accepted in one list */
+
+/* Parse "0-3,8,10-11" into cpus[]; returns the count, -1 on a bad list */
+int cpu_list_parse(const char *s, int *cpus, int max);
+
+/* Pin the calling thread to one cpu; 0 or -1 with errno set */
+int cpu_pin(int cpu);
+
+/* NUMA node of cpu from sysfs; 0 when the machine reports none */
+int cpu_node(int cpu);
+
+#endif /* __AFFINITY_H__ */
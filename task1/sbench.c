@@ -0,0 +1,188 @@
+/*
+ * sbench.c - show/trade mixes: readers-writers semaphores vs seqlock
+ *
+ * usage: ./sbench [threads] [stocks]
+ * Every thread runs the same mix: ratio shows (a copy of every stock, as
+ * show_stock makes) per trade (a buy or sell of a random stock, as
+ * buy_stock/sell_stock make). Each run lasts RUN_SEC seconds.
+ */
+#include "csapp.h"
+#include "seqlock.h"
+#include <time.h>
+
+#define DEFAULT_STOCKS 100
+#define RUN_SEC 0.5
+
+typedef struct {
+    int ID;
+    int left_stock;
+    int price;
+    int readcnt;
+    sem_t mutex, w;
+    seqlock_t seq;
+} item;
+
+typedef struct {
+    int kind; /* 0: readers-writers, 1: seqlock */
+    int ratio; /* shows per trade */
+    int n;
+    item* items;
+    volatile int stop;
+    long shows, trades; /* atomic */
+} bench_t;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void rw_begin(item* s)
+{
+    P(&s->mutex);
+    if (++s->readcnt == 1)
+        P(&s->w);
+    V(&s->mutex);
+}
+
+static void rw_end(item* s)
+{
+    P(&s->mutex);
+    if (--s->readcnt == 0)
+        V(&s->w);
+    V(&s->mutex);
+}
+
+static long show(bench_t* b)
+{
+    long sum = 0;
+    unsigned int q;
+    item* s;
+    int i, id, left, price;
+
+    for (i = 0; i < b->n; i++)
+    {
+        s = &b->items[i];
+        if (b->kind == 0)
+        {
+            rw_begin(s);
+            id = s->ID;
+            left = s->left_stock;
+            price = s->price;
+            rw_end(s);
+        }
+        else
+            do {
+                q = seq_read_begin(&s->seq);
+                id = __atomic_load_n(&s->ID, __ATOMIC_RELAXED);
+                left = __atomic_load_n(&s->left_stock, __ATOMIC_RELAXED);
+                price = __atomic_load_n(&s->price, __ATOMIC_RELAXED);
+            } while (seq_read_retry(&s->seq, q));
+        sum += id + left + price;
+    }
+    return sum;
+}
+
+static void trade(bench_t* b, item* s, int delta)
+{
+    if (b->kind == 0)
+    {
+        P(&s->w);
+        if (s->left_stock + delta >= 0)
+            s->left_stock += delta;
+        V(&s->w);
+    }
+    else
+    {
+        seq_write_lock(&s->seq);
+        if (s->left_stock + delta >= 0)
+            __atomic_store_n(&s->left_stock, s->left_stock + delta, __ATOMIC_RELAXED);
+        seq_write_unlock(&s->seq);
+    }
+}
+
+static void* run_thread(void* vargp)
+{
+    bench_t* b = vargp;
+    unsigned int r = (unsigned int)(long)pthread_self();
+    volatile long sink = 0;
+    long shows = 0, trades = 0;
+    int k;
+
+    while (!b->stop)
+    {
+        for (k = 0; k < b->ratio; k++, shows++)
+            sink += show(b);
+        r = r * 1103515245 + 12345;
+        trade(b, &b->items[(r >> 8) % b->n], (r & 1) ? 1 : -1);
+        trades++;
+    }
+    __atomic_add_fetch(&b->shows, shows, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->trades, trades, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void run(int kind, int ratio, int nthreads, int n, double* shows, double* trades)
+{
+    bench_t b;
+    pthread_t tid[64];
+    double t;
+    int i;
+
+    b.kind = kind;
+    b.ratio = ratio;
+    b.n = n;
+    b.items = Calloc(n, sizeof(item));
+    for (i = 0; i < n; i++)
+    {
+        b.items[i].ID = i + 1;
+        b.items[i].left_stock = 1000;
+        b.items[i].price = 100;
+        Sem_init(&b.items[i].mutex, 0, 1);
+        Sem_init(&b.items[i].w, 0, 1);
+    }
+    b.stop = 0;
+    b.shows = b.trades = 0;
+
+    t = now_sec();
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid[i], NULL, run_thread, &b);
+    usleep(RUN_SEC * 1e6);
+    b.stop = 1;
+    for (i = 0; i < nthreads; i++)
+        Pthread_join(tid[i], NULL);
+    t = now_sec() - t;
+
+    *shows = b.shows / t;
+    *trades = b.trades / t;
+    Free(b.items);
+}
+
+int main(int argc, char** argv)
+{
+    static const int ratios[] = { 1, 10, 100, 1000 };
+    int nthreads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int n = argc > 2 ? atoi(argv[2]) : DEFAULT_STOCKS;
+    double rs, rt, ss, st;
+    int i;
+
+    if (nthreads < 2)
+        nthreads = 2;
+    if (nthreads > 64)
+        nthreads = 64;
+    if (n < 1)
+        n = 1;
+
+    printf("%d threads, %d stocks per show\n", nthreads, n);
+    printf("%-11s %14s %14s %14s %14s %8s\n", "show:trade",
+        "rw shows/s", "rw trades/s", "seq shows/s", "seq trades/s", "speedup");
+    for (i = 0; i < (int)(sizeof(ratios) / sizeof(ratios[0])); i++)
+    {
+        run(0, ratios[i], nthreads, n, &rs, &rt);
+        run(1, ratios[i], nthreads, n, &ss, &st);
+        printf("%6d:1    %14.0f %14.0f %14.0f %14.0f %7.1fx\n", ratios[i], rs, rt, ss, st, ss / rs);
+    }
+    exit(0);
+}
@@ -0,0 +1,74 @@
+/*
+ * seqlock.h - sequence lock for small records that are read far more than written
+ *
+ * A writer makes the sequence odd while it changes the record and even
+ * again when it is done; writers exclude each other with a CAS on the
+ * same word. Readers never write shared memory: they copy the record and
+ * retry if the sequence was odd or has moved, so readers never block a
+ * writer and do not bounce a cache line among themselves. Fields of a
+ * protected record must be accessed with __atomic_load_n/__atomic_store_n
+ * (relaxed is enough; the sequence supplies the ordering).
+ */
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <sched.h>
+
+#define SEQ_SPIN 64 /* pause rounds before giving the cpu away */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define seq_relax() __builtin_ia32_pause()
+#else
+#define seq_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+typedef unsigned int seqlock_t; /* Initially = 0 */
+
+/* a writer may have been preempted inside: spin a little, then yield */
+static inline void seq_backoff(int *spins)
+{
+    if (++*spins % SEQ_SPIN == 0)
+        sched_yield();
+    else
+        seq_relax();
+}
+
+/* Start a read: the even sequence to hand to seq_read_retry */
+static inline unsigned int seq_read_begin(seqlock_t *sq)
+{
+    unsigned int s;
+    int spins = 0;
+
+    while ((s = __atomic_load_n(sq, __ATOMIC_ACQUIRE)) & 1)
+        seq_backoff(&spins);
+    return s;
+}
+
+/* Nonzero if a writer got in since seq_read_begin: the copy must be redone */
+static inline int seq_read_retry(seqlock_t *sq, unsigned int s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); /* the copy's loads before the re-check */
+    return __atomic_load_n(sq, __ATOMIC_RELAXED) != s;
+}
+
+static inline void seq_write_lock(seqlock_t *sq)
+{
+    unsigned int s;
+    int spins = 0;
+
+    while (1) {
+        s = __atomic_load_n(sq, __ATOMIC_RELAXED);
+        if (!(s & 1) && __atomic_compare_exchange_n(sq, &s, s + 1, 0,
+                                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        seq_backoff(&spins);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE); /* odd sequence before the field stores */
+}
+
+static inline void seq_write_unlock(seqlock_t *sq)
+{
+    __atomic_store_n(sq, __atomic_load_n(sq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* __SEQLOCK_H__ */
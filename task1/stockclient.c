@@ -4,6 +4,32 @@
 /* $begin echoclientmain */
 #include "csapp.h"
 
+/* 
+ * read_reply - read one length-prefixed reply ("<length>\n" + body,
+ * protocol 2) and copy the body to fp (discarded if fp is NULL)
+ */
+void read_reply(rio_t *rp, FILE *fp)
+{
+    char buf[MAXLINE];
+    int len, n;
+
+    if (Rio_readlineb(rp, buf, MAXLINE) == 0) {
+        fprintf(stderr, "server closed the connection\n");
+        exit(0);
+    }
+    len = atoi(buf);
+    while (len > 0) {
+        n = len < MAXLINE ? len : MAXLINE;
+        if (Rio_readnb(rp, buf, n) != n) {
+            fprintf(stderr, "server closed the connection\n");
+            exit(0);
+        }
+        if (fp)
+            Fwrite(buf, 1, n, fp);
+        len -= n;
+    }
+}
+
 int main(int argc, char **argv) 
 {
     int clientfd;
@@ -20,6 +46,10 @@ int main(int argc, char **argv)
     clientfd = Open_clientfd(host, port);
     Rio_readinitb(&rio, clientfd);
 
+    /* ask for framed replies instead of fixed MAXLINE blocks */
+    Rio_writen(clientfd, "proto 2\n", 8);
+    read_reply(&rio, NULL);
+
     while (Fgets(buf, MAXLINE, stdin) != NULL) {
         /*printf("1.buf:%s", buf);
    
@@ -27,10 +57,8 @@ int main(int argc, char **argv)
         if (buf[0] == '\0') printf("terminate\n");*/
         Rio_writen(clientfd, buf, strlen(buf));
        // printf("2.buf:%s", buf);
-        Rio_readlineb(&rio, buf, MAXLINE);
+        read_reply(&rio, stdout);
        // printf("3.buf:%s", buf);
-        Fputs(buf, stdout);
-       // printf("4.buf:%s", buf);
     }
     Close(clientfd); //line:netp:echoclient:close
     exit(0);
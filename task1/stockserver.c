@@ -3,342 +3,1834 @@
  */ 
 /* $begin echoserverimain */
 #include "csapp.h"
+#include "uring.h"
+#include "timer.h"
+#include "affinity.h"
+#include "seqlock.h"
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+
+/* glibc declares accept4 only under _GNU_SOURCE, which clashes with csapp.h's gai_error */
+extern int accept4(int sockfd, struct sockaddr* addr, socklen_t* addrlen, int flags);
+
+#define BACKEND_SELECT 0 /* select() + linear scan of conns[] */
+#define BACKEND_EPOLL  1 /* epoll, only ready descriptors are visited */
+#define BACKEND_URING  2 /* io_uring completion engine (falls back to epoll) */
+
+#define MAXEVENTS 1024 /* epoll_wait batch size */
+#define MAXCONN_EPOLL (1 << 16) /* default slot count for the epoll backend */
+#define LISTEN_TOKEN ((uint32_t)-1) /* epoll_event.data.u32 of listenfd */
+
+#define URING_ENTRIES 4096 /* SQ size; one SQE per connection is in flight at most */
+#define UOP_ACCEPT 1ULL /* user_data = (op << 32) | slot */
+#define UOP_RECV   2ULL
+#define UOP_SEND   3ULL
+
+#define PROTO_LEGACY 1 /* every reply is padded to MAXLINE bytes */
+#define PROTO_FRAMED 2 /* every reply is "<length>\n" followed by length bytes */
+
+#define HIGHWAT_DEFAULT (64 * MAXLINE) /* stop reading a client above this much unsent output */
+#define LOWWAT_DEFAULT  (16 * MAXLINE) /* and resume once it drains to this */
+
+/* conn.flags bits */
+#define CF_RD      0x01 /* read interest registered */
+#define CF_WR      0x02 /* write interest registered */
+#define CF_PAUSED  0x04 /* output above high watermark, reading paused */
+#define CF_EOF     0x08 /* peer sent EOF */
+#define CF_CLOSING 0x10 /* close once the output queue is drained */
+#define CF_FRAMED  0x20 /* client negotiated PROTO_FRAMED */
+#define CF_DIRTY   0x40 /* on the pool's flush list for this iteration */
+
+#define IOBUF_SIZE (2 * MAXLINE) /* pooled read buffer / output chunk */
+#define IOBUF_CACHE 256 /* free I/O buffers kept per reactor */
+#define OUTQ_CHUNK (IOBUF_SIZE - 2 * sizeof(int) - sizeof(void*)) /* outchunk fills one iobuf */
+#define OUTQ_IOVMAX 64 /* chunks handed to one sendmsg */
+
+#define STATS_WINDOW 1.0 /* seconds per accept-rate sample */
+
+#define TIMER_TICK_MS 100 /* timer wheel resolution */
+#define TM_IDLE    0 /* no request in progress */
+#define TM_REQUEST 1 /* part of a command line received, waiting for the rest */
+#define TM_WRITE   2 /* replies queued, client not reading them */
+#define UOP_TIMEOUT 4ULL /* io_uring: timer wheel tick */
+#define UOP_POLL    5ULL /* io_uring: idle connection became readable */
+
+typedef union iobuf { /*  I/O : Ͱ ִ ȸ    */
+    union iobuf* next; /* free list link */
+    char data[IOBUF_SIZE];
+} iobuf;
+
+typedef struct { /* "stats mem":  reactor atomic Ѵ */
+    long conns; /* open connections */
+    long conn_bytes; /* conn/uconn objects allocated (never returned) */
+    long iobufs; /* I/O buffers lent to connections */
+    long iobufs_cached; /* free I/O buffers kept for reuse */
+    long iobufs_peak;
+} mem_stats;
+
+mem_stats mem;
+
+void* iobuf_get(void);
+void iobuf_put(void* b);
+void show_mem(void);
+
+typedef struct outchunk {
+    struct outchunk* next;
+    int len; /* bytes filled */
+    int off; /* bytes already sent */
+    char data[OUTQ_CHUNK];
+} outchunk;
+
+typedef struct { /* Ằ  ť: chunk list,   sendmsg  */
+    outchunk* head;
+    outchunk* tail;
+    int pending; /* bytes queued but not yet sent */
+} outq;
+
+#define CONN_SLAB 64 /* conn objects carved from one allocation */
+
+typedef struct conn { /*  ϳ : slab Ҵϰ free list Ѵ */
+    int fd;
+    int flags; /* CF_* */
+    char* inbuf; /* borrowed iobuf while input is buffered, NULL when idle */
+    int inoff; /* first unread byte */
+    int inlen; /* unread bytes */
+    outq out; /* replies not yet sent */
+    tnode timer; /* id = slot */
+    struct conn* next; /* free list link */
+} conn;
 
 typedef struct { // represents a pool of connected descriptors
+    int backend; /* BACKEND_SELECT or BACKEND_EPOLL */
+    int listenfd;
     int maxfd;
     fd_set read_set;
     fd_set ready_set;
+    fd_set write_set;
+    fd_set ready_wset;
     int nready;
+    int listen_ready; /* listenfd became readable in the last wait */
     int maxi;
-    int clientfd[FD_SETSIZE];
-    rio_t clientrio[FD_SETSIZE];
+    int maxconn; /* number of client slots */
+    struct conn** conns; /* conns[maxconn], NULL if the slot is free */
+    int* freeslots; /* stack of free slot numbers, lowest on top */
+    int nfree;
+    int* dirty; /* slots with output to flush at the end of this iteration */
+    int ndirty;
+    int epfd; /* epoll instance (BACKEND_EPOLL) */
+    struct epoll_event* events; /* events[MAXEVENTS] (BACKEND_EPOLL) */
+    uint32_t evflags; /* EPOLLIN, plus EPOLLET in edge-triggered mode */
+    twheel wheel; /* idle / request / write timeouts */
 } pool;
 
-int byte_cnt = 0; //count total bytes recieved by server
+int byte_cnt = 0; //count total bytes recieved by server (atomic across reactors)
 
-void init_pool(int listenfd, pool* p);
+void init_pool(int listenfd, int backend, int maxconn, pool* p);
+void wait_pool(pool* p);
 void add_client(int connfd, pool* p);
+void remove_client(int i, pool* p);
+void serve_client(int i, pool* p);
+void mark_dirty(int i, pool* p);
+void flush_dirty(pool* p);
+int flush_client(int i, pool* p);
+void update_events(int i, pool* p);
 void check_clients(pool* p);
+void outq_append(outq* q, const char* data, int n);
+int outq_iov(outq* q, struct iovec* iov, int max);
+void outq_consume(outq* q, int n);
+void queue_reply(outq* q, int proto);
+void outq_free(outq* q);
+ssize_t conn_fill(conn* c);
+conn* conn_alloc(void);
+void conn_release(conn* c);
+int conn_getline(conn* c, char* usrbuf, int maxlen, int eof);
+void conn_idle(conn* c);
+
+typedef struct { /* io_uring    */
+    int fd; /* -1 if the slot is free */
+    int inlen; /* bytes pending in inbuf */
+    int closing; /* exit or EOF: close once out is sent */
+    int proto; /* PROTO_LEGACY or PROTO_FRAMED */
+    outq out; /* replies not yet sent */
+    struct msghdr msg; /* in-flight SENDMSG, must outlive the SQE */
+    struct iovec iov[OUTQ_IOVMAX];
+    tnode timer; /* id = slot */
+    char* inbuf; /* borrowed iobuf, NULL while waiting idle on POLL_ADD */
+} uconn;
+
+int run_command(int connfd, char* buf, int* proto);
+int uring_loop(int listenfd, int maxconn);
+
+typedef struct { /*  : main ϰ Ŀ б⸸ Ѵ */
+    char* port;
+    int backend;
+    int maxconn; /* client slots per reactor */
+    int nreactors;
+    int edge; /* register client fds with EPOLLET */
+    int highwat, lowwat; /* per-client output queue watermarks (bytes) */
+    int cork; /* keep client sockets TCP_CORKed between flushes */
+    int timeout[3]; /* seconds per TM_* kind, 0 = never */
+    int* cpus; /* -a: reactor r runs on cpus[r % ncpus] */
+    int ncpus; /* 0 = let the scheduler place threads */
+} server_conf;
+
+server_conf conf = { NULL, BACKEND_SELECT, 0, 1, 0, HIGHWAT_DEFAULT, LOWWAT_DEFAULT, 0, { 300, 30, 60 } };
+
+typedef struct { /*  :  reactor ϰ mutex ȣѴ */
+    double start; /* CLOCK_MONOTONIC seconds at startup */
+    long accepted; /* connections accepted so far */
+    long maxbatch; /* most connections accepted on one readiness event */
+    double win_start; /* current accept-rate window */
+    long win_cnt;
+    double win_rate; /* accepts/s over the last full window */
+    long timeouts[3]; /* connections closed per TM_* kind */
+    sem_t mutex;
+} server_stats;
+
+server_stats stats;
+
+double now_sec(void);
+void init_stats(void);
+void stats_accepted(int n);
+void show_stats(void);
+void stats_timeout(int kind);
+void accept_clients(int listenfd, pool* p);
+void conn_timer(twheel* tw, tnode* t, int pending, int partial, int progress);
+void expire_client(tnode* t, void* arg);
+
+int open_reuseport_listenfd(char* port);
+void event_loop(int listenfd);
+void* reactor(void* vargp);
+void pin_reactor(int r);
 
 
 /* ֽ   */
-char printbuf[MAXLINE]; /*   ϱ  迭 */
+__thread char printbuf[MAXLINE]; /*   ϱ  迭 (reactor ϳ) */
+sem_t file_mutex; /* stock.txt ⸦ ȣѴ */
+
+#define STOCK_FILE "stock.txt"
+#define STOCK_TMP  "stock.txt.tmp" /* written whole, then renamed over STOCK_FILE */
 
 typedef struct item { /* ֽ item */
     int ID;
     int left_stock;
     int price;
-    int readcnt;
+    seqlock_t seq; /* writers: buy/sell. readers: show, write_stock */
 }item;
 
-typedef struct node* node_pointer;
-typedef struct node { /* Ʈ  */
-    item stock;
-    node_pointer left_child;
-    node_pointer right_child;
-}node;
+#define STOCK_DENSE 4 /* direct index while the ID range is at most this many times the stock count */
+
+typedef struct { /* ֽ table: ID  ĵ item 迭 ID -> ġ index */
+    item* items; /* one allocation, sorted by ID */
+    int n;
+    int min_id;
+    int span; /* dense index: max ID - min_id + 1; 0 = hashed */
+    int* slot; /* position + 1 (0 = empty), at ID - min_id or at the ID's hash */
+    unsigned int mask; /* hashed: slots - 1 */
+} stock_table;
 
-node_pointer root = NULL; /* Ʈ */
+stock_table stocks;
 
-node_pointer create_node(item stock); /*   */
-node_pointer insert_node(node_pointer root, item stock); /* Ʈ   */
-node_pointer read_stock(); /* stock.txt о binary tree · Ѵ */
-void write_inorder(node_pointer root, FILE* fp);
-void write_stock(node_pointer root); /*  ֽ ¸ stock.txt  */
-void show_stock(int connfd, node_pointer root); /*  ֽ ¸ ش */
-struct node* tree_search(node_pointer root, int id); /* Ʈ id  带 ã ȯ */
-void buy_stock(int connfd, int id, int num, node_pointer root); /* ֽ  */
-void sell_stock(int connfd, int id, int num, node_pointer root); /* ֽ Ǹ */
-void free_tree(node_pointer root); /* Ʈ Ҵ ޸  */
+void read_stock(void); /* stock.txt о stocks  */
+void write_stock(void); /*  ֽ ¸ stock.txt  */
+item* stock_find(int id); /* id item,  NULL */
+void show_stock(int connfd); /*  ֽ ¸ ش */
+void buy_stock(int connfd, int id, int num); /* ֽ  */
+void sell_stock(int connfd, int id, int num); /* ֽ Ǹ */
+void item_read(item* stock, item* copy); /* seqlock reader:   纻 */
 
 
 /****************Լ ****************/
 
-node_pointer create_node(item stock)
+/* ֽ ID hash index  slot ´ (Fibonacci hashing) */
+static unsigned int stock_hash(int id)
+{
+    unsigned int h = (unsigned int)id * 0x9E3779B1u;
+
+    return h ^ (h >> 16);
+}
+
+/*
+ * ID -> ġ index . ID    STOCK_DENSE ̸
+ * ID - min_id ٷ ã 迭, ƴϸ linear probing hash .
+ *  ̵ slot ϳ int  鸸  index  MB .
+ */
+static void stock_index(stock_table* t)
 {
-    node_pointer new_node = (node_pointer)malloc(sizeof(node));
-    new_node->stock = stock;
-    new_node->left_child = new_node->right_child = NULL;
-    return new_node;
+    long span = t->n > 0 ? (long)t->items[t->n - 1].ID - t->items[0].ID + 1 : 0;
+    unsigned int cap = 2, h;
+    int i;
+
+    t->min_id = t->n > 0 ? t->items[0].ID : 0;
+    if (t->n > 0 && span <= (long)STOCK_DENSE * t->n)
+    {
+        t->span = (int)span;
+        t->slot = Calloc(span, sizeof(int));
+        for (i = 0; i < t->n; i++)
+            t->slot[t->items[i].ID - t->min_id] = i + 1;
+        return;
+    }
+    while (cap < 2 * (unsigned int)t->n) /* load factor <= 1/2 */
+        cap <<= 1;
+    t->span = 0;
+    t->mask = cap - 1;
+    t->slot = Calloc(cap, sizeof(int));
+    for (i = 0; i < t->n; i++)
+    {
+        for (h = stock_hash(t->items[i].ID) & t->mask; t->slot[h] != 0; h = (h + 1) & t->mask)
+            ;
+        t->slot[h] = i + 1;
+    }
 }
 
-node_pointer insert_node(node_pointer root, item stock)
+/* id item.   id NULL */
+item* stock_find(int id)
 {
-    if (root == NULL)
-        return create_node(stock);
+    stock_table* t = &stocks;
+    long off = (long)id - t->min_id;
+    unsigned int h;
+
+    if (t->span > 0)
+        return off >= 0 && off < t->span && t->slot[off] != 0 ? &t->items[t->slot[off] - 1] : NULL;
+    for (h = stock_hash(id) & t->mask; t->slot[h] != 0; h = (h + 1) & t->mask)
+        if (t->items[t->slot[h] - 1].ID == id)
+            return &t->items[t->slot[h] - 1];
+    return NULL;
+}
 
-    if (stock.ID < root->stock.ID)
-        root->left_child = insert_node(root->left_child, stock);
+typedef struct { /* stock.txt  : ϴ ȸ  */
+    int ID, left_stock, price;
+    int line;
+} stock_line;
 
-    else if (stock.ID > root->stock.ID)
-        root->right_child = insert_node(root->right_child, stock);
+static int stock_line_cmp(const void* a, const void* b)
+{
+    const stock_line* x = a;
+    const stock_line* y = b;
 
-    return root;
+    if (x->ID != y->ID)
+        return x->ID < y->ID ? -1 : 1;
+    return x->line - y->line;
 }
 
-node_pointer read_stock()
+/* stock.txt о ID  stocks 迭 index .  ID   ù ٸ  */
+void read_stock(void)
 {
-    node_pointer root = NULL;
-    FILE* fp = fopen("stock.txt", "r");
+    stock_line* raw = NULL;
+    int n = 0, cap = 0, i;
+    char line[100];
+    FILE* fp = fopen(STOCK_FILE, "r");
     if (fp == NULL)
     {
         fprintf(stderr, "fopen error\n");
         exit(1);
     }
 
-    char line[100];
     while (fgets(line, sizeof(line), fp))
     {
-        item stock;
-        sscanf(line, "%d %d %d", &stock.ID, &stock.left_stock, &stock.price);
-        root = insert_node(root, stock);
+        if (n == cap)
+        {
+            cap = cap == 0 ? 64 : cap * 2;
+            raw = Realloc(raw, cap * sizeof(stock_line));
+        }
+        if (sscanf(line, "%d %d %d", &raw[n].ID, &raw[n].left_stock, &raw[n].price) == 3)
+        {
+            raw[n].line = n;
+            n++;
+        }
     }
-
     fclose(fp);
-    return root;
-}
 
-void write_inorder(node_pointer root, FILE* fp)
-{
-    if (root == NULL)
-        return;
+    qsort(raw, n, sizeof(stock_line), stock_line_cmp);
+    stocks.items = Calloc(n > 0 ? n : 1, sizeof(item));
+    stocks.n = 0;
+    for (i = 0; i < n; i++)
+    {
+        item* s = &stocks.items[stocks.n];
 
-    write_inorder(root->left_child, fp);
-    fprintf(fp, "%d %d %d\n", root->stock.ID, root->stock.left_stock, root->stock.price);
-    write_inorder(root->right_child, fp);
+        if (stocks.n > 0 && s[-1].ID == raw[i].ID)
+            continue;
+        s->ID = raw[i].ID;
+        s->left_stock = raw[i].left_stock;
+        s->price = raw[i].price;
+        s->seq = 0;
+        stocks.n++;
+    }
+    Free(raw);
+    stock_index(&stocks);
 }
 
-void write_stock(node_pointer root)
+void write_stock(void)
 {
-    FILE* fp = fopen("stock.txt", "w");
+    item s;
+    int i;
+
+    P(&file_mutex); /* reactors flush concurrently; one STOCK_TMP at a time */
+    FILE* fp = fopen(STOCK_TMP, "w");
     if (fp == NULL)
     {
         fprintf(stderr, "fopen error\n");
         exit(1);
     }
 
-    write_inorder(root, fp);
+    for (i = 0; i < stocks.n; i++)
+    {
+        item_read(&stocks.items[i], &s);
+        fprintf(fp, "%d %d %d\n", s.ID, s.left_stock, s.price);
+    }
 
-    fclose(fp);
+    if (fclose(fp) != 0 || rename(STOCK_TMP, STOCK_FILE) < 0) /* never a half-written stock.txt */
+    {
+        fprintf(stderr, "write_stock error: %s\n", strerror(errno));
+        exit(1);
+    }
+    V(&file_mutex);
 }
 
-void init_pool(int listenfd, pool* p) 
+/*
+ * ID, ܷ,  lock  copy Ѵ. ϴ  buy/sell 
+ * ٽ ϹǷ    ʰ, writer reader ٸ ʴ´.
+ */
+void item_read(item* stock, item* copy)
+{
+    unsigned int s;
+
+    do {
+        s = seq_read_begin(&stock->seq);
+        copy->ID = __atomic_load_n(&stock->ID, __ATOMIC_RELAXED);
+        copy->left_stock = __atomic_load_n(&stock->left_stock, __ATOMIC_RELAXED);
+        copy->price = __atomic_load_n(&stock->price, __ATOMIC_RELAXED);
+    } while (seq_read_retry(&stock->seq, s));
+}
+
+void init_pool(int listenfd, int backend, int maxconn, pool* p) 
 {
     //Initially, no connected descripotrs 
     int i;
+    p->backend = backend;
+    p->listenfd = listenfd;
+    p->maxconn = maxconn;
+    p->conns = Calloc(maxconn, sizeof(conn*));
+    p->freeslots = Malloc(maxconn * sizeof(int));
+    p->dirty = Malloc(maxconn * sizeof(int));
+    p->ndirty = 0;
+    tw_init(&p->wheel, TIMER_TICK_MS);
     p->maxi = -1;
-    for (i = 0; i < FD_SETSIZE; i++) {
-        p->clientfd[i] = -1;
+    for (i = 0; i < maxconn; i++) /* slot 0 on top keeps maxi low for select */
+        p->freeslots[i] = maxconn - 1 - i;
+    p->nfree = maxconn;
+
+    if (backend == BACKEND_EPOLL)
+    {
+        struct epoll_event ev;
+
+        if ((p->epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+        p->events = Malloc(MAXEVENTS * sizeof(struct epoll_event));
+
+        p->evflags = EPOLLIN | (conf.edge ? EPOLLET : 0);
+        ev.events = EPOLLIN;
+        ev.data.u32 = LISTEN_TOKEN;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        return;
     }
 
     // Initially, listenfd is only member of select read set
     p->maxfd = listenfd;
     FD_ZERO(&p->read_set);
+    FD_ZERO(&p->write_set);
     FD_SET(listenfd, &p->read_set);
 }
 
-void add_client(int connfd, pool* p) 
+/* listenfd Ȥ connfd غǱ⸦ ٸ */
+void wait_pool(pool* p)
 {
-    int i;
-    p->nready--;
-    for (i = 0; i < FD_SETSIZE; i++)
+    int i, ms;
+    struct timeval tv;
+
+    if (p->backend == BACKEND_EPOLL)
     {
-        if (p->clientfd[i] < 0) //ִ  ã
+        while ((p->nready = epoll_wait(p->epfd, p->events, MAXEVENTS, tw_timeout(&p->wheel))) < 0)
         {
-            p->clientfd[i] = connfd; //connfd pool ߰Ѵ
-            Rio_readinitb(&p->clientrio[i], connfd);
-
-            FD_SET(connfd, &p->read_set); //connfd descriptor set ߰Ѵ
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+        }
 
-            // update max descriptor and pool high water mark 
-            if (connfd > p->maxfd)
-                p->maxfd = connfd;
-            if (i > p->maxi)
-                p->maxi = i;
-            break;
+        p->listen_ready = 0;
+        for (i = 0; i < p->nready; i++)
+        {
+            if (p->events[i].data.u32 == LISTEN_TOKEN)
+                p->listen_ready = 1;
         }
+        return;
+    }
+
+    p->ready_set = p->read_set;
+    p->ready_wset = p->write_set;
+    if ((ms = tw_timeout(&p->wheel)) >= 0)
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = ms * 1000;
     }
-       
-    if (i == FD_SETSIZE) //ִ  
-        app_error("add_client error: Too many clients");
+    p->nready = Select(p->maxfd + 1, &p->ready_set, &p->ready_wset, NULL, ms >= 0 ? &tv : NULL);
+    p->listen_ready = FD_ISSET(p->listenfd, &p->ready_set);
 }
 
-void show_stock(int connfd, node_pointer root) 
+void add_client(int connfd, pool* p) 
 {
-    if (root == NULL)
+    int i;
+    conn* c;
+
+    if (p->backend == BACKEND_SELECT && connfd >= FD_SETSIZE)
+    {
+        fprintf(stderr, "add_client error: fd %d exceeds FD_SETSIZE\n", connfd);
+        Close(connfd);
         return;
+    }
 
-    char tmpbuf[MAXLINE];
-   
-    show_stock(connfd, root->left_child);
-    sprintf(tmpbuf, "%d %d %d\n", root->stock.ID, root->stock.left_stock, root->stock.price);
-    strcat(printbuf, tmpbuf);
-    show_stock(connfd, root->right_child);
-}
+    if (p->nfree == 0)
+    {
+        //ִ     ʰ Ḹ Ѵ
+        fprintf(stderr, "add_client error: Too many clients\n");
+        Close(connfd);
+        return;
+    }
 
-struct node* tree_search(node_pointer root, int id) {
-    if (root == NULL || root->stock.ID == id)
-        return root;
+    i = p->freeslots[--p->nfree]; //ִ  O(1) 
+    c = p->conns[i] = conn_alloc();
+    c->fd = connfd; //connfd pool ߰Ѵ
+    c->inbuf = NULL; /* no buffer until the client sends something */
+    c->inoff = c->inlen = 0;
+    c->flags = CF_RD;
+    tw_node_init(&c->timer, i);
 
-    if (id < root->stock.ID)
-        return tree_search(root->left_child, id);
+    /* connfd accept4(SOCK_NONBLOCK) ޾Ҵ:  client   ʴ´ */
+    if (conf.cork)
+    {
+        int on = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
 
+    if (p->backend == BACKEND_EPOLL)
+    {
+        struct epoll_event ev;
+        ev.events = p->evflags;
+        ev.data.u32 = i;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
     else
-        return tree_search(root->right_child, id);
+    {
+        FD_SET(connfd, &p->read_set); //connfd descriptor set ߰Ѵ
+
+        // update max descriptor
+        if (connfd > p->maxfd)
+            p->maxfd = connfd;
+    }
+
+    // update pool high water mark 
+    if (i > p->maxi)
+        p->maxi = i;
+    conn_timer(&p->wheel, &c->timer, 0, 0, 0);
+}
+
+/*  i  ݰ pool Ѵ */
+void remove_client(int i, pool* p)
+{
+    conn* c = p->conns[i];
+    int connfd = c->fd;
+
+    /* close() drops the fd from the epoll interest list as well */
+    Close(connfd);
+    if (p->backend == BACKEND_SELECT)
+    {
+        FD_CLR(connfd, &p->read_set);
+        FD_CLR(connfd, &p->write_set);
+    }
+    p->conns[i] = NULL;
+    p->freeslots[p->nfree++] = i;
+    tw_del(&p->wheel, &c->timer);
+    outq_free(&c->out);
+    c->inlen = 0;
+    conn_idle(c);
+    conn_release(c);
+    write_stock();
 }
 
-void buy_stock(int connfd, int id, int num, node_pointer root) 
+/* conn slab:   CONN_SLAB   Ҵ free list ִ´ */
+static __thread conn* conn_freelist;
+
+conn* conn_alloc(void)
 {
-    if (root == NULL)
+    conn* c;
+    int k;
+
+    if (conn_freelist == NULL)
+    {
+        c = Malloc(CONN_SLAB * sizeof(conn));
+        __atomic_add_fetch(&mem.conn_bytes, CONN_SLAB * sizeof(conn), __ATOMIC_RELAXED);
+        for (k = 0; k < CONN_SLAB; k++)
+        {
+            c[k].out.head = c[k].out.tail = NULL;
+            c[k].out.pending = 0;
+            c[k].next = conn_freelist;
+            conn_freelist = &c[k];
+        }
+    }
+    c = conn_freelist;
+    conn_freelist = c->next;
+    __atomic_add_fetch(&mem.conns, 1, __ATOMIC_RELAXED);
+    return c;
+}
+
+void conn_release(conn* c)
+{
+    __atomic_sub_fetch(&mem.conns, 1, __ATOMIC_RELAXED);
+    c->fd = -1;
+    c->flags = 0;
+    c->next = conn_freelist;
+    conn_freelist = c;
+}
+
+/*  MAXLINE     ٿ ڸ */
+void show_stock(int connfd) 
+{
+    char row[64];
+    item s;
+    int i, n, len = 0;
+
+    for (i = 0; i < stocks.n; i++)
+    {
+        item_read(&stocks.items[i], &s);
+        n = sprintf(row, "%d %d %d\n", s.ID, s.left_stock, s.price);
+        if (len + n >= MAXLINE)
+            break;
+        memcpy(printbuf + len, row, n);
+        len += n;
+    }
+    printbuf[len] = '\0';
+}
+
+void buy_stock(int connfd, int id, int num) 
+{
+    item* target = stock_find(id);
+    int ok = 0;
+
+    if (target == NULL)
+    {
+        sprintf(printbuf, "No such stock\n");
         return;
+    }
 
-    node_pointer target = tree_search(root, id);
-   
-    if (target->stock.left_stock < num) 
+    /* ܷ Ȯΰ  write lock ȿ Բ ؾ  reactor ÿ 絵   ʴ´ */
+    seq_write_lock(&target->seq);
+    if (target->left_stock >= num)
+    {
+        __atomic_store_n(&target->left_stock, target->left_stock - num, __ATOMIC_RELAXED); //writing
+        ok = 1;
+    }
+    seq_write_unlock(&target->seq);
+
+    if (!ok) 
     {
         sprintf(printbuf, "Not enough left stock\n");
     }
     else 
     {
-        target->stock.left_stock -= num;
         sprintf(printbuf, "[buy] success\n");
     }
 }
 
-void sell_stock(int connfd, int id, int num, node_pointer root) 
+void sell_stock(int connfd, int id, int num) 
 {
-    if (root == NULL)
+    item* target = stock_find(id);
+
+    if (target == NULL)
+    {
+        sprintf(printbuf, "No such stock\n");
         return;
+    }
 
-    node_pointer target = tree_search(root, id);
-    target->stock.left_stock += num;
+    seq_write_lock(&target->seq);
+    __atomic_store_n(&target->left_stock, target->left_stock + num, __ATOMIC_RELAXED); //writing
+    seq_write_unlock(&target->seq);
     sprintf(printbuf, "[sell] success\n");
 }
  
-void check_clients(pool* p) 
+/*
+ * ɾ   ϰ  printbuf غѴ. exit̸ 1 ȯ.
+ * "proto <n>" switches the connection's reply framing in *proto; the
+ * acknowledgement itself is already sent in the new framing.
+ */
+int run_command(int connfd, char* buf, int* proto)
+{
+    char command[16]; command[0] = 0;
+    int id = 0;
+    int num = 0;
+    sscanf(buf, "%15s %d %d", command, &id, &num);
+    //printf("com:%s id:%d num:%d\n", command, id, num);
+
+    /*  ɾ  printbuf غѴ */
+    if (strcmp(command, "show") == 0) 
+    {
+        show_stock(connfd);
+        //printf("printbuf:: %s\n", printbuf); /*ӽ*/
+    }
+
+    else if (strcmp(command, "buy") == 0) 
+    {
+        buy_stock(connfd, id, num);
+        //printf("printbuf:: %s\n", printbuf); /*ӽ*/
+    }
+
+    else if (strcmp(command, "sell") == 0) 
+    {
+        sell_stock(connfd, id, num);
+        //printf("printbuf:: %s\n", printbuf); /*ӽ*/
+    }
+
+    else if (strcmp(command, "exit") == 0)
+    {
+        sprintf(printbuf, "exit the stock server\n");
+        return 1;
+    }
+
+    else if (strcmp(command, "proto") == 0)
+    {
+        if (id == PROTO_LEGACY || id == PROTO_FRAMED)
+        {
+            *proto = id;
+            sprintf(printbuf, "proto %d\n", id);
+        }
+        else
+            sprintf(printbuf, "unsupported protocol\n");
+    }
+
+    else if (strcmp(command, "stats") == 0)
+    {
+        char arg[16] = "";
+
+        sscanf(buf, "%*s %15s", arg);
+        if (strcmp(arg, "mem") == 0)
+            show_mem();
+        else
+            show_stats();
+    }
+    return 0;
+}
+
+double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void init_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.start = stats.win_start = now_sec();
+    Sem_init(&stats.mutex, 0, 1);
+}
+
+/* window  ֱ accept rate Ѵ. stats.mutex  ȣ */
+static void stats_roll(double now)
+{
+    if (now - stats.win_start < STATS_WINDOW)
+        return;
+    stats.win_rate = stats.win_cnt / (now - stats.win_start);
+    stats.win_start = now;
+    stats.win_cnt = 0;
+}
+
+/*   readiness event n  acceptߴ */
+void stats_accepted(int n)
+{
+    double now = now_sec();
+
+    P(&stats.mutex);
+    stats.accepted += n;
+    stats.win_cnt += n;
+    if (n > stats.maxbatch)
+        stats.maxbatch = n;
+    stats_roll(now);
+    V(&stats.mutex);
+}
+
+/* "stats" :  踦 printbuf  */
+void show_stats(void)
+{
+    double now = now_sec();
+
+    P(&stats.mutex);
+    stats_roll(now);
+    sprintf(printbuf, "accepted %ld conns in %.1fs (%.1f/s avg, %.1f/s last window, max batch %ld)\n"
+        "timed out %ld idle, %ld request, %ld write\n",
+        stats.accepted, now - stats.start, stats.accepted / (now - stats.start),
+        stats.win_rate, stats.maxbatch,
+        stats.timeouts[TM_IDLE], stats.timeouts[TM_REQUEST], stats.timeouts[TM_WRITE]);
+    V(&stats.mutex);
+}
+
+void stats_timeout(int kind)
+{
+    P(&stats.mutex);
+    stats.timeouts[kind]++;
+    V(&stats.mutex);
+}
+
+static const char* timeout_name[] = { "idle", "request", "write" };
+
+/*
+ * conn_timer -  ¿ ´ timeout timer ٽ Ǵ.
+ * Called after every read or write on the connection. Unsent output arms
+ * the write timeout, pushed back only when the client makes progress; a
+ * partial command line arms the request timeout, counted from its first
+ * byte so a slow sender cannot keep extending it; otherwise the idle
+ * timeout starts over.
+ */
+void conn_timer(twheel* tw, tnode* t, int pending, int partial, int progress)
+{
+    int kind = pending ? TM_WRITE : (partial ? TM_REQUEST : TM_IDLE);
+
+    if (tw_armed(t) && t->kind == kind &&
+        (kind == TM_REQUEST || (kind == TM_WRITE && !progress)))
+        return;
+    t->kind = kind;
+    tw_add(tw, t, conf.timeout[kind] * 1000);
+}
+
+/*
+ * conn_fill -  Է ۿ  Ʈ ڷ ̾ д´.
+ * The buffer is borrowed from the iobuf pool on the first read and kept
+ * while a partial line is pending, so several commands arriving in one
+ * read() are not lost.  Ʈ , EOF 0,  EAGAIN̸ -1.
+ */
+ssize_t conn_fill(conn* c)
+{
+    ssize_t n;
+
+    if (c->inbuf == NULL)
+        c->inbuf = iobuf_get();
+    if (c->inlen > 0 && c->inoff > 0)
+        memmove(c->inbuf, c->inbuf + c->inoff, c->inlen);
+    c->inoff = 0;
+
+    while ((n = recv(c->fd, c->inbuf + c->inlen, IOBUF_SIZE - c->inlen, MSG_DONTWAIT)) < 0
+        && errno == EINTR)
+        ;
+    if (n > 0)
+        c->inlen += n;
+    return n;
+}
+
+/*
+ * conn_getline - Է ۿ ϼ  ϳ . ϼ   0.
+ * Like Rio_readlineb, a line longer than maxlen-1 is split, and at EOF a
+ * trailing line without '\n' is returned as is.
+ */
+int conn_getline(conn* c, char* usrbuf, int maxlen, int eof)
 {
-    int i, connfd, n;
+    char* nl;
+    char* start = c->inbuf + c->inoff;
+    int n;
+
+    if (c->inlen == 0)
+        return 0;
+
+    if ((nl = memchr(start, '\n', c->inlen)) != NULL)
+        n = nl - start + 1;
+    else if (eof || c->inlen >= maxlen - 1)
+        n = c->inlen;
+    else
+        return 0;
+    if (n > maxlen - 1)
+        n = maxlen - 1;
+
+    memcpy(usrbuf, start, n);
+    usrbuf[n] = 0;
+    c->inoff += n;
+    c->inlen -= n;
+    return n;
+}
+
+/* Է  ó ۸ pool ش: idle  ۸  ʴ´ */
+void conn_idle(conn* c)
+{
+    if (c->inbuf != NULL && c->inlen == 0)
+    {
+        iobuf_put(c->inbuf);
+        c->inbuf = NULL;
+        c->inoff = 0;
+    }
+}
+
+/*  ִ I/O ۵ reactor ϰ, ġ ýۿ ش */
+static __thread iobuf* iobuf_cache;
+static __thread int iobuf_ncached;
+
+void* iobuf_get(void)
+{
+    iobuf* b = iobuf_cache;
+    long n, peak;
+
+    if (b != NULL)
+    {
+        iobuf_cache = b->next;
+        iobuf_ncached--;
+        __atomic_sub_fetch(&mem.iobufs_cached, 1, __ATOMIC_RELAXED);
+    }
+    else
+        b = Malloc(sizeof(iobuf));
+
+    n = __atomic_add_fetch(&mem.iobufs, 1, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&mem.iobufs_peak, __ATOMIC_RELAXED);
+    while (n > peak && !__atomic_compare_exchange_n(&mem.iobufs_peak, &peak, n, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return b;
+}
+
+void iobuf_put(void* p)
+{
+    iobuf* b = p;
+
+    __atomic_sub_fetch(&mem.iobufs, 1, __ATOMIC_RELAXED);
+    if (iobuf_ncached >= IOBUF_CACHE)
+    {
+        Free(b);
+        return;
+    }
+    b->next = iobuf_cache;
+    iobuf_cache = b;
+    iobuf_ncached++;
+    __atomic_add_fetch(&mem.iobufs_cached, 1, __ATOMIC_RELAXED);
+}
+
+/* "stats mem" : ޸ 뷮 printbuf  */
+void show_mem(void)
+{
+    long conns = __atomic_load_n(&mem.conns, __ATOMIC_RELAXED);
+    long bufs = __atomic_load_n(&mem.iobufs, __ATOMIC_RELAXED);
+    long cached = __atomic_load_n(&mem.iobufs_cached, __ATOMIC_RELAXED);
+
+    sprintf(printbuf, "conns %ld, conn objects %ld bytes\n"
+        "iobufs %ld in use (%ld bytes), %ld cached, peak %ld, %d bytes each\n",
+        conns, __atomic_load_n(&mem.conn_bytes, __ATOMIC_RELAXED),
+        bufs, bufs * (long)IOBUF_SIZE, cached,
+        __atomic_load_n(&mem.iobufs_peak, __ATOMIC_RELAXED), IOBUF_SIZE);
+}
+
+static outchunk* outchunk_get(void)
+{
+    outchunk* c = iobuf_get();
+
+    c->next = NULL;
+    c->len = c->off = 0;
+    return c;
+}
+
+static void outchunk_put(outchunk* c)
+{
+    iobuf_put(c);
+}
+
+/*  ť  δ */
+void outq_append(outq* q, const char* data, int n)
+{
+    int room;
+
+    q->pending += n;
+    while (n > 0)
+    {
+        if (q->tail == NULL || q->tail->len == OUTQ_CHUNK)
+        {
+            outchunk* c = outchunk_get();
+            if (q->tail)
+                q->tail->next = c;
+            else
+                q->head = c;
+            q->tail = c;
+        }
+        room = OUTQ_CHUNK - q->tail->len;
+        if (room > n)
+            room = n;
+        memcpy(q->tail->data + q->tail->len, data, room);
+        q->tail->len += room;
+        data += room;
+        n -= room;
+    }
+}
+
+/*   κ iovec . iov ä  ȯ */
+int outq_iov(outq* q, struct iovec* iov, int max)
+{
+    outchunk* c;
+    int cnt = 0;
+
+    for (c = q->head; c != NULL && cnt < max; c = c->next)
+    {
+        iov[cnt].iov_base = c->data + c->off;
+        iov[cnt].iov_len = c->len - c->off;
+        cnt++;
+    }
+    return cnt;
+}
+
+/* n bytes ۵Ǿ:   chunk ش */
+void outq_consume(outq* q, int n)
+{
+    outchunk* c;
+    int k;
+
+    q->pending -= n;
+    while (n > 0)
+    {
+        c = q->head;
+        k = c->len - c->off;
+        if (k > n)
+        {
+            c->off += n;
+            return;
+        }
+        n -= k;
+        q->head = c->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+        outchunk_put(c);
+    }
+}
+
+/* printbuf   protocol ° ť ִ´ */
+void queue_reply(outq* q, int proto)
+{
+    char hdr[16];
+    int len, n;
+
+    if (proto == PROTO_LEGACY)
+    {
+        outq_append(q, printbuf, MAXLINE); /* old clients read fixed MAXLINE blocks */
+        return;
+    }
+
+    len = strlen(printbuf);
+    n = sprintf(hdr, "%d\n", len);
+    outq_append(q, hdr, n);
+    outq_append(q, printbuf, len);
+}
+
+void outq_free(outq* q)
+{
+    outchunk* c;
+
+    while ((c = q->head) != NULL)
+    {
+        q->head = c->next;
+        outchunk_put(c);
+    }
+    q->tail = NULL;
+    q->pending = 0;
+}
+
+/*
+ * update_events -  i ¿ ° read/write interest ٽ Ѵ.
+ * Read interest is dropped while the client is paused, closing or at EOF;
+ * write interest is held only while the output queue is non-empty.
+ */
+void update_events(int i, pool* p)
+{
+    conn* c = p->conns[i];
+    int connfd = c->fd;
+    int flags = c->flags;
+    int want = 0;
+
+    if (!(flags & (CF_PAUSED | CF_EOF | CF_CLOSING)))
+        want |= CF_RD;
+    if (c->out.pending > 0)
+        want |= CF_WR;
+    if (want == (flags & (CF_RD | CF_WR)))
+        return;
+
+    if (p->backend == BACKEND_EPOLL)
+    {
+        struct epoll_event ev;
+        ev.events = (want & CF_RD ? p->evflags : (p->evflags & EPOLLET)) | (want & CF_WR ? EPOLLOUT : 0);
+        ev.data.u32 = i;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_MOD, connfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
+    else
+    {
+        if (want & CF_RD)
+            FD_SET(connfd, &p->read_set);
+        else
+            FD_CLR(connfd, &p->read_set);
+        if (want & CF_WR)
+            FD_SET(connfd, &p->write_set);
+        else
+            FD_CLR(connfd, &p->write_set);
+    }
+    c->flags = (flags & ~(CF_RD | CF_WR)) | want;
+}
+
+/*
+ * flush_client -  ť  ۰ ϴ ŭ  watermark Ѵ.
+ * All chunks queued for the client go out in one sendmsg (gather write).
+ * Returns -1 if the client was removed (write error, or drained while closing).
+ */
+int flush_client(int i, pool* p)
+{
+    conn* c = p->conns[i];
+    outq* q = &c->out;
+    struct iovec iov[OUTQ_IOVMAX];
+    struct msghdr msg;
+    ssize_t n;
+    int drained = q->pending > 0, progress = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    while (q->pending > 0)
+    {
+        msg.msg_iovlen = outq_iov(q, iov, OUTQ_IOVMAX);
+        if ((n = sendmsg(c->fd, &msg, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            remove_client(i, p); /* EPIPE, ECONNRESET, ... */
+            return -1;
+        }
+        outq_consume(q, n);
+        progress = 1;
+    }
+
+    /* corked: push out the partial segment at the end of the batch */
+    if (conf.cork && drained && q->pending == 0)
+    {
+        int off = 0, on = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+
+    if (q->pending > conf.highwat)
+        c->flags |= CF_PAUSED;
+    else if (q->pending <= conf.lowwat)
+        c->flags &= ~CF_PAUSED;
+
+    if (q->pending == 0 && (c->flags & CF_CLOSING))
+    {
+        remove_client(i, p);
+        return -1;
+    }
+    update_events(i, p);
+    conn_timer(&p->wheel, &c->timer, q->pending > 0, c->inlen > 0, progress);
+    return 0;
+}
+
+/*
+ * run_lines - Է ۿ ̹  ϼ   ϰ  ť ״´.
+ * Stops early when the queue crosses the high watermark; the rest of the
+ * lines stay buffered until the client drains.
+ */
+static void run_lines(int i, pool* p)
+{
+    conn* c = p->conns[i];
+    outq* q = &c->out;
+    int n, proto, eof = c->flags & CF_EOF;
     char buf[MAXLINE];
-    rio_t rio;
+
+    while (!(c->flags & (CF_PAUSED | CF_CLOSING)))
+    {
+        if ((n = conn_getline(c, buf, MAXLINE, eof)) == 0)
+        {
+            if (eof)
+                c->flags |= CF_CLOSING; /* all input consumed */
+            return;
+        }
+
+        printf("Server received %d (%d total) bytes on fd %d\n",
+            n, __atomic_add_fetch(&byte_cnt, n, __ATOMIC_RELAXED), c->fd);
+
+        proto = (c->flags & CF_FRAMED) ? PROTO_FRAMED : PROTO_LEGACY;
+        if (run_command(c->fd, buf, &proto))
+            c->flags |= CF_CLOSING;
+        if (proto == PROTO_FRAMED)
+            c->flags |= CF_FRAMED;
+        else
+            c->flags &= ~CF_FRAMED;
+
+        queue_reply(q, proto);
+        memset(printbuf, 0, sizeof(printbuf));
+
+        if (q->pending > conf.highwat)
+            c->flags |= CF_PAUSED;
+    }
+}
+
+/*
+ *  i connfd  ͸ о ϼ    óѴ.
+ * Replies are only queued here; flush_dirty sends them at the end of the
+ * loop iteration. Level-triggered: one read per wakeup, leftovers are
+ * picked up next time. Edge-triggered: keep reading until EAGAIN.
+ */
+void serve_client(int i, pool* p)
+{
+    conn* c = p->conns[i];
+    int reads = 0;
+    ssize_t rc;
+
+    while (1)
+    {
+        run_lines(i, p);
+
+        if (c->flags & (CF_PAUSED | CF_CLOSING | CF_EOF))
+            break; /* wait for the output queue to drain */
+        if (reads > 0 && !(p->evflags & EPOLLET))
+            break;
+
+        reads++;
+        if ((rc = conn_fill(c)) == 0) //EOF 
+            c->flags |= CF_EOF;
+        else if (rc < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            remove_client(i, p); /* connection reset etc. */
+            return;
+        }
+    }
+    conn_idle(c);
+    mark_dirty(i, p);
+}
+
+/* ̹ iteration    i  ť  Ѵ */
+void mark_dirty(int i, pool* p)
+{
+    conn* c = p->conns[i];
+
+    if (c->flags & CF_DIRTY)
+        return;
+    c->flags |= CF_DIRTY;
+    p->dirty[p->ndirty++] = i;
+}
+
+/*
+ * flush_dirty - iteration    Ḷ sendmsg   .
+ * A client that drains below the low watermark is served again right
+ * away, since the lines it sent while paused are already buffered.
+ */
+void flush_dirty(pool* p)
+{
+    int k, i, paused;
+    conn* c;
+
+    for (k = 0; k < p->ndirty; k++)
+    {
+        i = p->dirty[k];
+        /* a removed client has left its slot (conns[i] == NULL) */
+        while ((c = p->conns[i]) != NULL && (c->flags & CF_DIRTY))
+        {
+            c->flags &= ~CF_DIRTY;
+            paused = c->flags & CF_PAUSED;
+            if (flush_client(i, p) < 0 || !paused || (c->flags & CF_PAUSED))
+                break;
+            c->flags |= CF_DIRTY; /* keep slot i off the list while re-serving */
+            serve_client(i, p);
+        }
+    }
+    p->ndirty = 0;
+}
+
+void check_clients(pool* p) 
+{
+    int i, connfd, rd, wr;
+    uint32_t ev;
+    conn* c;
+
+    if (p->backend == BACKEND_EPOLL)
+    {
+        /* only descriptors reported by epoll_wait are visited */
+        for (i = 0; i < p->nready; i++)
+        {
+            if (p->events[i].data.u32 == LISTEN_TOKEN)
+                continue;
+
+            int slot = p->events[i].data.u32;
+            if ((c = p->conns[slot]) == NULL)
+                continue;
+            ev = p->events[i].events;
+            if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                serve_client(slot, p);
+            if (p->conns[slot] == c && (ev & EPOLLOUT)) /* still connected */
+                mark_dirty(slot, p);
+        }
+        flush_dirty(p);
+        return;
+    }
 
     for (i = 0; (i <= p->maxi) && (p->nready > 0); i++) 
     {
-        connfd = p->clientfd[i];
-        rio = p->clientrio[i];
+        if ((c = p->conns[i]) == NULL)
+            continue;
+        connfd = c->fd;
+
+        rd = FD_ISSET(connfd, &p->ready_set); //if connfd is ready
+        wr = FD_ISSET(connfd, &p->ready_wset);
+        p->nready -= rd + wr;
+        if (rd)
+            serve_client(i, p);
+        if (wr && p->conns[i] == c)
+            mark_dirty(i, p);
+    }
+    flush_dirty(p);
+}
+
+/**************** io_uring engine ****************/
+/*
+ * accept, recv and send are all submitted as SQEs and the whole batch is
+ * handed to the kernel with one io_uring_enter per loop iteration. Each
+ * connection has exactly one recv or send in flight: a recv completion
+ * runs the complete lines in inbuf (up to the high watermark of queued
+ * output), and the slot then sends until its queue is drained before
+ * running more lines or reading again. An idle connection has no inbuf:
+ * it waits on POLL_ADD and borrows an iobuf only when data arrives.
+ */
+static __thread uring_t ring; /* one ring per reactor thread */
+static __thread uconn** uconns; /* uconns[maxconn], allocated on first use */
+static __thread int* ufree; /* stack of free slots */
+static __thread int unfree;
+static __thread twheel* uwheel; /* connection timeouts of this ring */
+static __thread int utick_queued; /* an IORING_OP_TIMEOUT tick is in flight */
+
+static struct io_uring_sqe* uring_sqe(void)
+{
+    struct io_uring_sqe* sqe;
+
+    /* SQ full: push what we have to the kernel and try again */
+    while ((sqe = uring_get_sqe(&ring)) == NULL)
+    {
+        if (uring_submit_and_wait(&ring, 0) < 0)
+            unix_error("io_uring_enter error");
+    }
+    return sqe;
+}
 
-        if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set))) //if connfd is ready
-        { 
-            p->nready--;
-            if ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) //line 
+/* Ÿ̸Ӱ ɷ   tick ڿ  TIMEOUT ִ´ */
+static void uring_queue_tick(void)
+{
+    static __thread struct __kernel_timespec ts;
+
+    if (utick_queued || tw_timeout(uwheel) < 0)
+        return;
+    ts.tv_sec = 0;
+    ts.tv_nsec = TIMER_TICK_MS * 1000000LL;
+    uring_prep_timeout(uring_sqe(), &ts, UOP_TIMEOUT << 32);
+    utick_queued = 1;
+}
+
+/* timer wheel callback: in-flight recv/send  shutdownϰ Ϸῡ ݴ´ */
+static void uconn_expire(tnode* t, void* arg)
+{
+    uconn* c = uconns[t->id];
+
+    printf("%s timeout on fd %d\n", timeout_name[t->kind], c->fd);
+    stats_timeout(t->kind);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+static void uring_queue_accept(int listenfd, struct sockaddr_storage* addr, socklen_t* addrlen)
+{
+    *addrlen = sizeof(struct sockaddr_storage);
+    uring_prep_accept(uring_sqe(), listenfd, (SA*)addr, addrlen, UOP_ACCEPT << 32);
+}
+
+/*  Է  ۸ ְ POLL_ADD,  ̾ RECVѴ */
+static void uring_queue_recv(int i)
+{
+    uconn* c = uconns[i];
+
+    if (c->inlen == 0 && c->inbuf != NULL)
+    {
+        iobuf_put(c->inbuf);
+        c->inbuf = NULL;
+    }
+    if (c->inbuf == NULL)
+    {
+        uring_prep_poll_in(uring_sqe(), c->fd, (UOP_POLL << 32) | i);
+        return;
+    }
+    /* at most MAXLINE - 1 bytes buffered: a line and its NUL fit buf in uconn_run_lines */
+    uring_prep_recv(uring_sqe(), c->fd, c->inbuf + c->inlen, MAXLINE - 1 - c->inlen,
+        (UOP_RECV << 32) | i);
+}
+
+/*   chunk ü SENDMSG ϳ  */
+static void uring_queue_send(int i)
+{
+    uconn* c = uconns[i];
+
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = outq_iov(&c->out, c->iov, OUTQ_IOVMAX);
+    uring_prep_sendmsg(uring_sqe(), c->fd, &c->msg, (UOP_SEND << 32) | i);
+}
+
+/*   O(1) . uconn  ó   Ҵϰ  Ѵ */
+static int uconn_add(int connfd)
+{
+    int i;
+
+    if (unfree == 0)
+        return -1;
+    i = ufree[--unfree];
+    if (uconns[i] == NULL)
+    {
+        uconns[i] = Calloc(1, sizeof(uconn));
+        __atomic_add_fetch(&mem.conn_bytes, sizeof(uconn), __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&mem.conns, 1, __ATOMIC_RELAXED);
+
+    uconns[i]->fd = connfd;
+    uconns[i]->inlen = 0;
+    uconns[i]->closing = 0;
+    uconns[i]->proto = PROTO_LEGACY;
+    tw_node_init(&uconns[i]->timer, i);
+    conn_timer(uwheel, &uconns[i]->timer, 0, 0, 0);
+    return i;
+}
+
+static void uconn_close(int i)
+{
+    Close(uconns[i]->fd);
+    uconns[i]->fd = -1;
+    ufree[unfree++] = i;
+    tw_del(uwheel, &uconns[i]->timer);
+    outq_free(&uconns[i]->out);
+    if (uconns[i]->inbuf != NULL)
+    {
+        iobuf_put(uconns[i]->inbuf);
+        uconns[i]->inbuf = NULL;
+    }
+    __atomic_sub_fetch(&mem.conns, 1, __ATOMIC_RELAXED);
+    write_stock();
+}
+
+/* inbuf ϼ  ϰ  out ״´ (high watermark) */
+static void uconn_run_lines(uconn* c)
+{
+    char buf[MAXLINE];
+    char* nl;
+    int n;
+
+    while (!c->closing && c->inlen > 0 && c->out.pending <= conf.highwat)
+    {
+        if ((nl = memchr(c->inbuf, '\n', c->inlen)) != NULL)
+            n = nl - c->inbuf + 1;
+        else if (c->inlen >= MAXLINE - 1)
+            n = c->inlen; /* over-long line: take it as is, like Rio_readlineb */
+        else
+            break;
+
+        memcpy(buf, c->inbuf, n);
+        buf[n] = 0;
+        c->inlen -= n;
+        memmove(c->inbuf, c->inbuf + n, c->inlen);
+
+        printf("Server received %d (%d total) bytes on fd %d\n",
+            n, __atomic_add_fetch(&byte_cnt, n, __ATOMIC_RELAXED), c->fd);
+
+        c->closing = run_command(c->fd, buf, &c->proto);
+
+        queue_reply(&c->out, c->proto);
+        memset(printbuf, 0, sizeof(printbuf));
+    }
+}
+
+/* Ŀ io_uring   -1 ȯϰ, ϸ ȯ ʴ´ */
+int uring_loop(int listenfd, int maxconn)
+{
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_TIMEOUT,
+        IORING_OP_POLL_ADD };
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    char client_hostname[NI_MAXHOST], client_port[NI_MAXSERV];
+    struct io_uring_cqe* cqe;
+    unsigned long long op;
+    int i, res;
+    uconn* c;
+
+    if (uring_init(&ring, URING_ENTRIES, 4 * URING_ENTRIES) < 0)
+        return -1;
+    if (uring_probe_ops(&ring, ops, 5) < 0)
+    {
+        uring_exit(&ring);
+        return -1;
+    }
+
+    ufree = Malloc(maxconn * sizeof(int));
+    for (unfree = 0; unfree < maxconn; unfree++)
+        ufree[unfree] = maxconn - 1 - unfree;
+    uconns = Calloc(maxconn, sizeof(uconn*));
+    uwheel = Malloc(sizeof(twheel));
+    tw_init(uwheel, TIMER_TICK_MS);
+    uring_queue_accept(listenfd, &clientaddr, &clientlen);
+
+    while (1)
+    {
+        uring_queue_tick();
+        if (uring_submit_and_wait(&ring, 1) < 0)
+            unix_error("io_uring_enter error");
+
+        while ((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            op = cqe->user_data >> 32;
+            i = (int)(cqe->user_data & 0xffffffff);
+            res = cqe->res;
+            uring_cqe_seen(&ring);
+
+            if (op == UOP_TIMEOUT) /* -ETIME */
             {
-                byte_cnt += n;
-                printf("Server received %d (%d total) bytes on fd %d\n",
-                    n, byte_cnt, connfd);
-                
-                char command[5]; command[0] = 0;
-                int id = 0;
-                int num = 0;
-                sscanf(buf, "%s %d %d", command, &id, &num);
-                //printf("com:%s id:%d num:%d\n", command, id, num);
- 
-                /*  ɾ  printbuf غѴ */
-                if (strcmp(command, "show") == 0) 
-                {
-                    show_stock(connfd, root);
-                    //printf("printbuf:: %s\n", printbuf); /*ӽ*/
-                }
+                utick_queued = 0;
+                continue;
+            }
 
-                else if (strcmp(command, "buy") == 0) 
+            if (op == UOP_ACCEPT)
+            {
+                if (res >= 0)
                 {
-                    buy_stock(connfd, id, num, root);
-                    //printf("printbuf:: %s\n", printbuf); /*ӽ*/
-                }
+                    if (getnameinfo((SA*)&clientaddr, clientlen, client_hostname, NI_MAXHOST,
+                        client_port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+                        printf("Connected to (%s, %s)\n", client_hostname, client_port);
+                    stats_accepted(1);
 
-                else if (strcmp(command, "sell") == 0) 
-                {
-                    sell_stock(connfd, id, num, root);
-                    //printf("printbuf:: %s\n", printbuf); /*ӽ*/
+                    if ((i = uconn_add(res)) < 0)
+                    {
+                        fprintf(stderr, "add_client error: Too many clients\n");
+                        Close(res);
+                    }
+                    else
+                    {
+                        if (conf.cork)
+                        {
+                            int on = 1;
+                            setsockopt(res, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+                        }
+                        uring_queue_recv(i);
+                    }
                 }
+                else if (res != -EINTR && res != -ECONNABORTED)
+                    fprintf(stderr, "accept error: %s\n", strerror(-res));
+                uring_queue_accept(listenfd, &clientaddr, &clientlen);
+                continue;
+            }
 
-                else if (strcmp(command, "exit") == 0)
-                {
-                    sprintf(printbuf, "exit the stock server\n");
-                   
-                    Close(connfd);
-                    FD_CLR(connfd, &p->read_set);
-                    p->clientfd[i] = -1;
-                    write_stock(root);
-                }
+            c = uconns[i];
+            if (res <= 0) //EOF Ȥ 
+            {
+                uconn_close(i);
+                continue;
+            }
 
-                /* غ printbuf connfd  */
-                Rio_writen(connfd, printbuf, sizeof(printbuf));
-                memset(printbuf, 0, sizeof(printbuf));
+            if (op == UOP_POLL) /* Ͱ   ۸  */
+            {
+                c->inbuf = iobuf_get();
+                uring_prep_recv(uring_sqe(), c->fd, c->inbuf, MAXLINE - 1, (UOP_RECV << 32) | i);
+                continue;
             }
 
-            else //EOF 
+            if (op == UOP_RECV)
+            {
+                c->inlen += res;
+                uconn_run_lines(c);
+            }
+            else
             {
-                Close(connfd);
-                FD_CLR(connfd, &p->read_set);
-                p->clientfd[i] = -1;
-                write_stock(root);
+                outq_consume(&c->out, res);
+                if (c->out.pending == 0)
+                {
+                    if (conf.cork)
+                    {
+                        int off = 0, on = 1;
+                        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+                        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+                    }
+                    uconn_run_lines(c); /* lines held back by the high watermark */
+                }
             }
+
+            conn_timer(uwheel, &c->timer, c->out.pending > 0, c->inlen > 0, op == UOP_SEND);
+            if (c->out.pending > 0)
+                uring_queue_send(i);
+            else if (c->closing)
+                uconn_close(i);
+            else
+                uring_queue_recv(i);
         }
+        tw_advance(uwheel, uconn_expire, NULL);
     }
 }
 
-/* ӽ */
-void printStockTree(struct node* root) {
-    if (root == NULL) {
-        return;
+
+/* open_listenfd  SO_REUSEPORT  reactor  Ʈ  listenѴ */
+int open_reuseport_listenfd(char* port)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    Getaddrinfo(NULL, port, &hints, &listp);
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int));
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void*)&optval, sizeof(int));
+
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        Close(listenfd);
     }
-    printStockTree(root->left_child);
-    printf("ID: %d, Left Stock: %d, Price: %d\n", root->stock.ID, root->stock.left_stock, root->stock.price);
-    printStockTree(root->right_child);
+
+    Freeaddrinfo(listp);
+    if (!p)
+        return -1;
+
+    if (listen(listenfd, LISTENQ) < 0) {
+        Close(listenfd);
+        return -1;
+    }
+    return listenfd;
 }
 
+/* listenfd ϳ pool ϳ  ̺Ʈ  */
+void event_loop(int listenfd)
+{
+    int backend = conf.backend;
+    pool pool;
 
-/**************** main ****************/
-int main(int argc, char ** argv) 
+    if (backend == BACKEND_URING)
+    {
+        uring_loop(listenfd, conf.maxconn); /* returns only if io_uring is unusable */
+        fprintf(stderr, "io_uring unavailable (%s), falling back to epoll\n", strerror(errno));
+        backend = BACKEND_EPOLL;
+    }
+    init_pool(listenfd, backend, conf.maxconn, &pool);
+    /* accept_clients drains the backlog until EAGAIN */
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+    while (1) {
+        //listenfd Ȥ connfd غǱ⸦ ٸ
+        wait_pool(&pool);
+
+        // If listenfd is ready, add new clients to pool
+        if (pool.listen_ready) 
+            accept_clients(listenfd, &pool);
+
+        //  ready connfdκ ؽƮ о óѴ
+        check_clients(&pool);
+
+        tw_advance(&pool.wheel, expire_client, &pool);
+    }
+}
+
+/* timer wheel callback: timeout   ݴ´ */
+void expire_client(tnode* t, void* arg)
+{
+    pool* p = arg;
+
+    printf("%s timeout on fd %d\n", timeout_name[t->kind], p->conns[t->id]->fd);
+    stats_timeout(t->kind);
+    remove_client(t->id, p);
+}
+
+/*
+ * accept_clients - listen backlog   EAGAIN    ޴´.
+ * Peer names are logged numerically so the accept path never waits on a
+ * resolver while other clients are ready.
+ */
+void accept_clients(int listenfd, pool* p)
 {
-    int listenfd, connfd;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
-    static pool pool;
-    char client_hostname[MAXLINE], client_port[MAXLINE];
+    char client_hostname[NI_MAXHOST], client_port[NI_MAXSERV];
+    int connfd, n = 0;
 
-    root = read_stock();
-    //printStockTree(root); /* ӽ */
+    if (p->backend == BACKEND_SELECT)
+        p->nready--; /* epoll: nready is the length of events[], keep it */
+
+    while (1)
+    {
+        clientlen = sizeof(struct sockaddr_storage);
+        if ((connfd = accept4(listenfd, (SA*)&clientaddr, &clientlen, SOCK_NONBLOCK)) < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "accept error: %s\n", strerror(errno)); /* EMFILE etc.: retry next wakeup */
+            break;
+        }
+        n++;
 
+        if (getnameinfo((SA*)&clientaddr, clientlen, client_hostname, NI_MAXHOST,
+            client_port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+            printf("Connected to (%s, %s)\n", client_hostname, client_port);
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(0);
+        add_client(connfd, p);
     }
+    if (n > 0)
+        stats_accepted(n);
+}
 
-    listenfd = Open_listenfd(argv[1]);
-    init_pool(listenfd, &pool);
+/*
+ * -a cpu ־ reactor r cpus[r % ncpus] Ѵ. pool, ring,
+ *  ۴     thread ó Ƿ  cpu NUMA node .
+ */
+void pin_reactor(int r)
+{
+    int cpu;
 
-    while (1) {
-        //listenfd Ȥ connfd غǱ⸦ ٸ
-        pool.ready_set = pool.read_set;
-        pool.nready = Select(pool.maxfd + 1, &pool.ready_set, NULL, NULL, NULL);
+    if (conf.ncpus == 0)
+        return;
+    cpu = conf.cpus[r % conf.ncpus];
+    if (cpu_pin(cpu) < 0)
+        unix_error("cpu_pin error");
+    printf("reactor %d on cpu %d (node %d)\n", r, cpu, cpu_node(cpu));
+}
 
-        // If listenfd is ready, add new client to pool
-        if (FD_ISSET(listenfd, &pool.ready_set)) 
-        {
-            clientlen = sizeof(struct sockaddr_storage);
-            connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+/* reactor thread routine: ڱ listenfd pool  */
+void* reactor(void* vargp)
+{
+    int listenfd;
 
-            Getnameinfo((SA*)&clientaddr, clientlen, client_hostname, MAXLINE, 
-                client_port, MAXLINE, 0);
-            printf("Connected to (%s, %s)\n", client_hostname, client_port);
+    pin_reactor((int)(long)vargp);
+    if ((listenfd = open_reuseport_listenfd(conf.port)) < 0)
+        unix_error("open_reuseport_listenfd error");
+    event_loop(listenfd);
+    return NULL;
+}
 
-            add_client(connfd, &pool);
+void usage(char* prog)
+{
+    fprintf(stderr, "usage: %s <port> [-b select|epoll|uring] [-e] [-n maxconn] [-r nreactors]\n"
+        "       [-w highwat[,lowwat]] [-c] [-t idle[,request[,write]]] [-a cpulist]\n", prog);
+    exit(0);
+}
+
+/* epoll 鿣 ⺻  : RLIMIT_NOFILE hard limit ÷ Ѵ */
+int default_maxconn(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return FD_SETSIZE;
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > MAXCONN_EPOLL)
+        return MAXCONN_EPOLL;
+    return (int)rl.rlim_cur;
+}
+
+
+/**************** main ****************/
+int main(int argc, char ** argv) 
+{
+    int i, opt;
+    pthread_t* tids;
+
+    while ((opt = getopt(argc, argv, "a:b:cen:r:t:w:")) != -1) {
+        switch (opt) {
+        case 'a':
+            conf.cpus = Malloc(CPU_LIST_MAX * sizeof(int));
+            if ((conf.ncpus = cpu_list_parse(optarg, conf.cpus, CPU_LIST_MAX)) < 0)
+                usage(argv[0]);
+            break;
+        case 'b':
+            if (strcmp(optarg, "select") == 0)
+                conf.backend = BACKEND_SELECT;
+            else if (strcmp(optarg, "epoll") == 0)
+                conf.backend = BACKEND_EPOLL;
+            else if (strcmp(optarg, "uring") == 0)
+                conf.backend = BACKEND_URING;
+            else
+                usage(argv[0]);
+            break;
+        case 'c':
+            conf.cork = 1;
+            break;
+        case 'e':
+            conf.edge = 1;
+            break;
+        case 'n':
+            conf.maxconn = atoi(optarg);
+            break;
+        case 'r':
+            conf.nreactors = atoi(optarg);
+            if (conf.nreactors <= 0)
+                conf.nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 't':
+            if (sscanf(optarg, "%d,%d,%d", &conf.timeout[TM_IDLE], &conf.timeout[TM_REQUEST],
+                &conf.timeout[TM_WRITE]) < 1 || conf.timeout[TM_IDLE] < 0 ||
+                conf.timeout[TM_REQUEST] < 0 || conf.timeout[TM_WRITE] < 0)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d,%d", &conf.highwat, &conf.lowwat) == 1)
+                conf.lowwat = conf.highwat / 4;
+            if (conf.highwat < MAXLINE || conf.lowwat < 0 || conf.lowwat > conf.highwat)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
         }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    conf.port = argv[optind];
 
-        //  ready connfdκ ؽƮ о óѴ
-        check_clients(&pool);
+    if (conf.backend == BACKEND_SELECT)
+        conf.maxconn = FD_SETSIZE;
+    else
+    {
+        if (conf.maxconn <= 0)
+            conf.maxconn = default_maxconn();
+        conf.maxconn = (conf.maxconn + conf.nreactors - 1) / conf.nreactors; /* per reactor */
     }
+
+    Sem_init(&file_mutex, 0, 1);
+    init_stats();
+    /* main thread ù cpu Ѵ: catalog  cpu node  */
+    if (conf.nreactors == 1)
+        pin_reactor(0); /* main runs the only reactor */
+    else if (conf.ncpus > 0 && cpu_pin(conf.cpus[0]) < 0)
+        unix_error("cpu_pin error");
+    read_stock();
+
+    if (conf.nreactors == 1)
+    {
+        event_loop(Open_listenfd(conf.port));
+        exit(0);
+    }
+
+    /* reactor SO_REUSEPORT listenfd  Ŀ  ھ лѴ */
+    tids = Malloc(conf.nreactors * sizeof(pthread_t));
+    for (i = 0; i < conf.nreactors; i++)
+        Pthread_create(&tids[i], NULL, reactor, (void*)(long)i);
+    for (i = 0; i < conf.nreactors; i++)
+        Pthread_join(tids[i], NULL);
     exit(0);
 }
 /* $end echoserverimain */
@@ -0,0 +1,245 @@
+/*
+ * uring.c - minimal io_uring submission/completion ring
+ *
+ * Only what the stock server needs: one SQ/CQ pair mapped from the
+ * ring fd, SQE allocation, batched submit, and CQE peeking.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t *r, unsigned entries, unsigned cq_entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+
+    if ((r->ring_fd = sys_io_uring_setup(entries, &p)) < 0)
+        return -1;
+
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz)
+            r->sq_sz = r->cq_sz;
+        r->cq_sz = r->sq_sz;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = r->sq_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sqe_tail = *r->sq_tail;
+
+    cq = r->cq_ptr;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+ fail:
+    uring_exit(r);
+    return -1;
+}
+
+void uring_exit(uring_t *r)
+{
+    int saved = errno;
+
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_sz);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_sz);
+    if (r->ring_fd >= 0)
+        close(r->ring_fd);
+    r->ring_fd = -1;
+    errno = saved;
+}
+
+/* Returns 0 if every opcode in ops[] is supported by the running kernel */
+int uring_probe_ops(uring_t *r, const int *ops, int nops)
+{
+    struct io_uring_probe *probe;
+    size_t sz = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int i, rc = 0;
+
+    if ((probe = calloc(1, sz)) == NULL)
+        return -1;
+    if (sys_io_uring_register(r->ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        rc = -1;
+    for (i = 0; rc == 0 && i < nops; i++) {
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            rc = -1;
+        }
+    }
+    free(probe);
+    return rc;
+}
+
+/* Returns a zeroed SQE, or NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned idx;
+
+    if (r->sqe_tail - head >= r->sq_entries)
+        return NULL;
+    idx = r->sqe_tail & *r->sq_mask;
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    memset(&r->sqes[idx], 0, sizeof(struct io_uring_sqe));
+    return &r->sqes[idx];
+}
+
+/*
+ * Publish every SQE handed out since the last call and enter the kernel
+ * once, optionally waiting for wait_nr completions.
+ */
+int uring_submit_and_wait(uring_t *r, unsigned wait_nr)
+{
+    unsigned to_submit;
+    int rc;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    do {
+        rc = sys_io_uring_enter(r->ring_fd, to_submit, wait_nr,
+                                wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (rc < 0 && errno == EINTR);
+
+    /* CQ ring overflow backlog: caller reaps completions and retries */
+    if (rc < 0 && (errno == EBUSY || errno == EAGAIN))
+        return 0;
+    return rc;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *r)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, unsigned long long user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->addr2 = (unsigned long)addrlen;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+                     unsigned long long user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf,
+                     unsigned len, unsigned long long user_data)
+{
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                        unsigned long long user_data)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+/* Completes with -ETIME once *ts has elapsed */
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        unsigned long long user_data)
+{
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+/* One-shot readiness: completes with the revents mask once fd is readable */
+void uring_prep_poll_in(struct io_uring_sqe *sqe, int fd, unsigned long long user_data)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,45 @@
+/*
+ * uring.h - minimal io_uring submission/completion ring (raw syscalls,
+ *           no liburing dependency)
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sqe_tail;          /* next SQE handed out, published on submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+} uring_t;
+
+/* Returns -1 (errno set) when the kernel lacks io_uring or an opcode we need */
+int uring_init(uring_t *r, unsigned entries, unsigned cq_entries);
+void uring_exit(uring_t *r);
+int uring_probe_ops(uring_t *r, const int *ops, int nops);
+
+struct io_uring_sqe *uring_get_sqe(uring_t *r);
+int uring_submit_and_wait(uring_t *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring_t *r);
+void uring_cqe_seen(uring_t *r);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, unsigned long long user_data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len,
+                     unsigned long long user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf,
+                     unsigned len, unsigned long long user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                        unsigned long long user_data);
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+                        unsigned long long user_data);
+void uring_prep_poll_in(struct io_uring_sqe *sqe, int fd, unsigned long long user_data);
+
+#endif /* __URING_H__ */
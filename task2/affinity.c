@@ -0,0 +1,75 @@
+/*
+ * affinity.c - CPU pinning and NUMA node lookup
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include "affinity.h"
+
+int cpu_list_parse(const char *s, int *cpus, int max)
+{
+    char *end;
+    long lo, hi, c;
+    int n = 0;
+
+    while (*s) {
+        lo = strtol(s, &end, 10);
+        if (end == s || lo < 0)
+            return -1;
+        hi = lo;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            if (end == s + 1 || hi < lo)
+                return -1;
+            s = end;
+        }
+        for (c = lo; c <= hi; c++) {
+            if (n == max || c >= CPU_SETSIZE)
+                return -1;
+            cpus[n++] = (int)c;
+        }
+        if (*s == ',')
+            s++;
+        else if (*s != '\0')
+            return -1;
+    }
+    return n > 0 ? n : -1;
+}
+
+int cpu_pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path)) == NULL)
+        return 0;
+    while ((d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, "node", 4) == 0 && d->d_name[4] >= '0' && d->d_name[4] <= '9') {
+            node = atoi(d->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
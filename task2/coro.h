@@ -0,0 +1,52 @@
+/*
+ * coro.h - stackless coroutines for C (protothread style)
+ *
+ * A coroutine is an ordinary function whose body sits between CO_BEGIN
+ * and CO_END. CO_AWAIT saves the current line in the coroutine's state
+ * and returns what it is waiting for; the next call jumps straight back
+ * to that line through the switch. The state is one int, so a suspended
+ * coroutine costs no stack, but locals are NOT preserved across a
+ * CO_AWAIT: anything still needed afterwards must live in the caller's
+ * per-coroutine struct. Do not put a CO_AWAIT inside a switch statement
+ * of your own.
+ */
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#define CO_DONE  0 /* finished; the scheduler frees the session */
+#define CO_READ  1 /* resume when the fd is readable */
+#define CO_WRITE 2 /* resume when the fd is writable */
+#define CO_CALL  3 /* resume when another thread answers; the fd is ignored meanwhile */
+
+typedef struct {
+    int line; /* where to resume: 0 = start, -1 = finished */
+} coro_t;
+
+#define CO_INIT(c) ((c)->line = 0)
+
+#define CO_BEGIN(c)      \
+    switch ((c)->line) { \
+    case 0:
+
+/* Suspend until what (CO_READ/CO_WRITE/CO_CALL) is ready, then continue here */
+#define CO_AWAIT(c, what)        \
+    do {                         \
+        (c)->line = __LINE__;    \
+        return (what);           \
+    case __LINE__:;              \
+    } while (0)
+
+/* Finish from anywhere in the body */
+#define CO_EXIT(c)          \
+    do {                    \
+        (c)->line = -1;     \
+        return CO_DONE;     \
+    } while (0)
+
+#define CO_END(c)       \
+    default:;           \
+    }                   \
+    (c)->line = -1;     \
+    return CO_DONE
+
+#endif /* __CORO_H__ */
@@ -0,0 +1,102 @@
+/*
+ * idtab.c - int ID -> pointer index, lock-free lookups
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "idtab.h"
+
+#define IDTAB_MIN 16
+#define TAG(id) ((unsigned long)(unsigned int)(id) << 1 | 1)
+
+/* ID  slot ´ (Fibonacci hashing) */
+static unsigned long id_hash(int id)
+{
+    unsigned int h = (unsigned int)id * 0x9E3779B1u;
+
+    return h ^ (h >> 16);
+}
+
+idtab *idtab_new(long n)
+{
+    unsigned long cap = IDTAB_MIN;
+    idtab *t;
+
+    while (cap < 4 * (unsigned long)n) /* a quarter full: room to grow before the next copy */
+        cap <<= 1;
+    t = calloc(1, sizeof(idtab) + cap * sizeof(idtab_slot));
+    if (t == NULL)
+        abort();
+    t->mask = cap - 1;
+    return t;
+}
+
+void idtab_free(idtab *t)
+{
+    free(t);
+}
+
+void *idtab_get(idtab *t, int id)
+{
+    unsigned long tag = TAG(id), k, i;
+
+    for (i = id_hash(id) & t->mask; (k = __atomic_load_n(&t->slot[i].tag, __ATOMIC_ACQUIRE)) != 0;
+         i = (i + 1) & t->mask)
+        if (k == tag)
+            return __atomic_load_n(&t->slot[i].val, __ATOMIC_ACQUIRE);
+    return NULL;
+}
+
+/* id's slot, or the empty slot that ends its probe chain */
+static idtab_slot *find_slot(idtab *t, int id)
+{
+    unsigned long tag = TAG(id), i;
+
+    for (i = id_hash(id) & t->mask; t->slot[i].tag != 0 && t->slot[i].tag != tag; i = (i + 1) & t->mask)
+        ;
+    return &t->slot[i];
+}
+
+idtab *idtab_put(idtab **tp, int id, void *val)
+{
+    idtab *t = *tp, *n, *old = NULL;
+    idtab_slot *s = find_slot(t, id);
+    unsigned long i;
+
+    if (s->tag == 0 && 2 * (t->used + 1) > (long)t->mask + 1) {
+        n = idtab_new(t->live + 1); /* dropped IDs are left behind */
+        for (i = 0; i <= t->mask; i++)
+            if (t->slot[i].val != NULL) {
+                idtab_slot *d = find_slot(n, (int)(t->slot[i].tag >> 1));
+
+                d->tag = t->slot[i].tag;
+                d->val = t->slot[i].val;
+                n->used++;
+                n->live++;
+            }
+        __atomic_store_n(tp, n, __ATOMIC_RELEASE);
+        old = t;
+        t = n;
+        s = find_slot(t, id);
+    }
+    if (s->tag == 0) {
+        __atomic_store_n(&s->val, val, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->tag, TAG(id), __ATOMIC_RELEASE); /* a lookup that sees the key sees val */
+        t->used++;
+        t->live++;
+    } else {
+        if (s->val == NULL)
+            t->live++;
+        __atomic_store_n(&s->val, val, __ATOMIC_RELEASE);
+    }
+    return old;
+}
+
+void idtab_drop(idtab *t, int id, void *val)
+{
+    idtab_slot *s = find_slot(t, id);
+
+    if (s->tag != 0 && s->val == val) {
+        __atomic_store_n(&s->val, NULL, __ATOMIC_RELEASE);
+        t->live--;
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * idtab.h - int ID -> pointer index, lock-free lookups
+ *
+ * Open addressing with linear probing, at most half full. A slot's key is
+ * claimed once and never changes; dropping an ID only clears its value,
+ * so a lookup that raced with a writer still walks a valid probe chain.
+ * When the claimed keys reach half the slots, the writer builds a bigger
+ * table from the live entries, publishes it and hands the old one back:
+ * lookups may still be reading it, so the caller frees it only once they
+ * are known to be done (the same rule as for removed skip list nodes).
+ *
+ * idtab_get may run anywhere; idtab_put and idtab_drop on one table must
+ * be serialised by the caller.
+ */
+#ifndef __IDTAB_H__
+#define __IDTAB_H__
+
+typedef struct {
+    unsigned long tag;         /* (id << 1) | 1 once claimed, 0 = empty (atomic) */
+    void *val;                 /* NULL = dropped (atomic) */
+} idtab_slot;
+
+typedef struct idtab {
+    unsigned long mask;        /* slots - 1 */
+    long used;                 /* claimed slots, live or dropped (writer) */
+    long live;                 /* slots with a value (writer) */
+    unsigned long retired;     /* caller's stamp once replaced */
+    struct idtab *free_next;   /* caller's list of replaced tables */
+    idtab_slot slot[];
+} idtab;
+
+/* Empty table with room for n IDs */
+idtab *idtab_new(long n);
+void idtab_free(idtab *t);
+
+/* The value for id, or NULL */
+void *idtab_get(idtab *t, int id);
+
+/*
+ * Map id to val in *tp. Returns NULL, or the table that a grown copy just
+ * replaced in *tp (published with release); the caller retires it.
+ */
+idtab *idtab_put(idtab **tp, int id, void *val);
+
+/* Clear id if it still maps to val: a newer mapping is left alone */
+void idtab_drop(idtab *t, int id, void *val);
+
+#endif /* __IDTAB_H__ */
@@ -0,0 +1,197 @@
+/*
+ * lbench.c - the task2 catalog: skip list nodes found through the skip
+ *            list (list/delist) vs through the ID index (buy/sell)
+ *
+ * usage: ./lbench [stocks] [threads]
+ * trade: every thread looks up its own stock and CASes the hot line, as
+ *        stock_order does (the version it would push is left out); the
+ *        stocks are neighbours, so any cache line they share bounces.
+ * find:  one thread looks up random IDs.
+ * scan:  one thread reads ID, left_stock and price of every stock in ID
+ *        order, as show_stock/write_stock do (without the formatting).
+ */
+#include "csapp.h"
+#include "skiplist.h"
+#include "idtab.h"
+#include <time.h>
+
+#define DEFAULT_STOCKS 1000000
+#define TRADE_OPS 2000000 /* per thread */
+#define SCAN_ROUNDS 20
+#define FIND_OPS 2000000
+#define LINE 64
+
+enum { SKIP, INDEX, NLOOKUP };
+static const char* names[NLOOKUP] = { "skip", "idtab" };
+
+typedef struct { /* like the server's stock_node: key and levels, then the hot line */
+    sl_node sl;
+    int state;
+    int row_len;
+    char row[32];
+    long left_stock __attribute__((aligned(LINE))); /* stands in for head */
+    int price;
+} skip_node;
+
+typedef struct {
+    skiplist list;
+    idtab* index;
+    int n;
+} table;
+
+typedef struct {
+    table* t;
+    int kind;
+    int id; /* the stock this thread trades */
+} trader;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static skip_node* lookup(table* t, int kind, int id)
+{
+    return kind == SKIP ? (skip_node*)sl_find(&t->list, id) : idtab_get(t->index, id);
+}
+
+/* read_stockó skip list ְ index  */
+static void build(table* t, int n)
+{
+    skip_node* s;
+    int i;
+
+    t->n = n;
+    sl_init(&t->list);
+    for (i = n; i > 0; i--) /* so no insert walks the whole bottom level */
+    {
+        s = sl_alloc(sizeof(skip_node));
+        s->sl.key = i;
+        s->price = 100 + (i - 1) % 1000;
+        s->left_stock = 1000;
+        sl_insert(&t->list, &s->sl);
+    }
+    t->index = idtab_new(n);
+    for (s = (skip_node*)sl_first(&t->list); s != NULL; s = (skip_node*)sl_next(&s->sl))
+        idtab_put(&t->index, s->sl.key, s);
+}
+
+static void destroy(table* t)
+{
+    sl_node *s, *next;
+
+    for (s = sl_first(&t->list); s != NULL; s = next)
+    {
+        next = sl_next(s);
+        sl_free(s);
+    }
+    idtab_free(t->index);
+}
+
+static void* trade(void* vargp)
+{
+    trader* tr = vargp;
+    skip_node* s;
+    long k, v;
+
+    for (k = 0; k < TRADE_OPS; k++)
+    {
+        s = lookup(tr->t, tr->kind, tr->id);
+        v = __atomic_load_n(&s->left_stock, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&s->left_stock, &v, v + (k & 1 ? 1 : -1), 0,
+            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) /* buy, sell, buy, ... */
+            ;
+    }
+    return NULL;
+}
+
+/* trade ops/s over all threads */
+static double run_trade(table* t, int kind, int nthreads)
+{
+    pthread_t tid[64];
+    trader tr[64];
+    double s;
+    int i;
+
+    s = now_sec();
+    for (i = 0; i < nthreads; i++)
+    {
+        tr[i].t = t;
+        tr[i].kind = kind;
+        tr[i].id = i + 1;
+        Pthread_create(&tid[i], NULL, trade, &tr[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+        Pthread_join(tid[i], NULL);
+    return (double)TRADE_OPS * nthreads / (now_sec() - s);
+}
+
+/* ns per lookup of a random ID */
+static double run_find(table* t, int kind)
+{
+    volatile long sink;
+    unsigned long x = 88172645463325252UL;
+    long sum = 0, k;
+    double s;
+    int id;
+
+    s = now_sec();
+    for (k = 0; k < FIND_OPS; k++)
+    {
+        x ^= x << 13; /* xorshift */
+        x ^= x >> 7;
+        x ^= x << 17;
+        id = (int)(x % t->n) + 1;
+        sum += lookup(t, kind, id)->left_stock;
+    }
+    sink = sum;
+    (void)sink;
+    return (now_sec() - s) * 1e9 / FIND_OPS;
+}
+
+/* ns per stock of one ordered pass */
+static double run_scan(table* t)
+{
+    volatile long sink;
+    skip_node* s;
+    long sum = 0;
+    double t0;
+    int r;
+
+    t0 = now_sec();
+    for (r = 0; r < SCAN_ROUNDS; r++)
+        for (s = (skip_node*)sl_first(&t->list); s != NULL; s = (skip_node*)sl_next(&s->sl))
+            sum += s->sl.key + s->left_stock + s->price;
+    sink = sum;
+    (void)sink;
+    return (now_sec() - t0) * 1e9 / ((double)SCAN_ROUNDS * t->n);
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : DEFAULT_STOCKS;
+    int nthreads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int node_bytes = sizeof(skip_node) + 2 * sizeof(sl_node*); /* two levels on average */
+    table t;
+    int k;
+
+    if (nthreads < 2)
+        nthreads = 2;
+    if (nthreads > 64)
+        nthreads = 64;
+    if (n < nthreads)
+        n = nthreads;
+
+    build(&t, n);
+    printf("%d stocks, %d trading threads, %d bytes/node, index %.1f bytes/stock\n", n, nthreads, node_bytes,
+        (double)(t.index->mask + 1) * sizeof(idtab_slot) / n);
+    printf("%-8s %16s %14s\n", "lookup", "trade ops/s", "find ns");
+    for (k = 0; k < NLOOKUP; k++)
+        printf("%-8s %16.0f %14.1f\n", names[k], run_trade(&t, k, nthreads), run_find(&t, k));
+    printf("scan (show, stock.txt): %.2f ns/stock\n", run_scan(&t));
+    destroy(&t);
+    exit(0);
+}
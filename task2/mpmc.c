@@ -0,0 +1,202 @@
+/*
+ * mpmc.c - bounded lock-free multi-producer/multi-consumer queue of ints
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mpmc.h"
+
+#define SPIN_MIN 16    /* adaptive spin budget, in try/pause rounds */
+#define SPIN_MAX 4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static __thread int spin_budget = SPIN_MIN;
+static int spin_cap = SPIN_MAX; /* 0 on a single CPU: the other side cannot run while we spin */
+
+static void futex_wait(int *addr, int val, const struct timespec *rel)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, rel, NULL, 0);
+}
+
+static long long clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void mpmc_init(mpmc_t *q, int n)
+{
+    unsigned long cap = 1, i;
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) <= 1)
+        spin_cap = 0;
+
+    while (cap < (unsigned long)n)
+        cap <<= 1;
+    q->cells = malloc(cap * sizeof(mpmc_cell));
+    if (q->cells == NULL)
+        abort();
+    for (i = 0; i < cap; i++)
+        q->cells[i].seq = i;
+    q->mask = cap - 1;
+    q->head = q->tail = 0;
+    q->items = q->item_waiters = 0;
+    q->slots = q->slot_waiters = 0;
+}
+
+void mpmc_deinit(mpmc_t *q)
+{
+    free(q->cells);
+}
+
+int mpmc_try_push(mpmc_t *q, int item)
+{
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    mpmc_cell *c;
+    long dif;
+
+    while (1) {
+        c = &q->cells[pos & q->mask];
+        dif = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;              /* pos reloaded on failure */
+        } else if (dif < 0)
+            return -1;              /* full: the cell still holds an item */
+        else
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+    c->item = item;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int mpmc_try_pop(mpmc_t *q, int *item)
+{
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    mpmc_cell *c;
+    long dif;
+
+    while (1) {
+        c = &q->cells[pos & q->mask];
+        dif = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0)
+            return -1;              /* empty */
+        else
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+    *item = c->item;
+    __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Wake one thread parked on *ev, if any. Pairs with the re-check in wait_until() */
+static void signal_ev(int *ev, int *waiters)
+{
+    __atomic_add_fetch(ev, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(ev);
+}
+
+static int try_push(mpmc_t *q, int *item)
+{
+    return mpmc_try_push(q, *item);
+}
+
+/*
+ * Spin on try() for the thread's budget, then sleep on *ev. The budget
+ * doubles when spinning succeeds and halves when we had to sleep, so a
+ * busy queue is handed off without syscalls and an idle one costs no CPU.
+ * Gives up after timeout_ms (-1: never) and returns -1.
+ */
+static int wait_until(int (*try)(mpmc_t *, int *), mpmc_t *q, int *item,
+                      int *ev, int *waiters, int timeout_ms)
+{
+    int k, key, limit = spin_budget < spin_cap ? spin_budget : spin_cap;
+    long long deadline = 0, left;
+    struct timespec rel;
+
+    for (k = 0; k < limit; k++) {
+        if (try(q, item) == 0) {
+            if (spin_budget < SPIN_MAX)
+                spin_budget <<= 1;
+            return 0;
+        }
+        cpu_relax();
+    }
+    if (spin_budget > SPIN_MIN)
+        spin_budget >>= 1;
+
+    if (timeout_ms >= 0)
+        deadline = clock_ms() + timeout_ms;
+    while (1) {
+        key = __atomic_load_n(ev, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+        if (try(q, item) == 0) {
+            __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+            return 0;
+        }
+        if (timeout_ms < 0)
+            futex_wait(ev, key, NULL); /* returns at once if *ev has moved */
+        else {
+            if ((left = deadline - clock_ms()) <= 0) {
+                __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+                return -1;
+            }
+            rel.tv_sec = left / 1000;
+            rel.tv_nsec = (left % 1000) * 1000000;
+            futex_wait(ev, key, &rel);
+        }
+        __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void mpmc_push(mpmc_t *q, int item)
+{
+    wait_until(try_push, q, &item, &q->slots, &q->slot_waiters, -1);
+    signal_ev(&q->items, &q->item_waiters);
+}
+
+int mpmc_pop(mpmc_t *q)
+{
+    int item;
+
+    wait_until(mpmc_try_pop, q, &item, &q->items, &q->item_waiters, -1);
+    signal_ev(&q->slots, &q->slot_waiters);
+    return item;
+}
+
+int mpmc_pop_timed(mpmc_t *q, int *item, int timeout_ms)
+{
+    if (wait_until(mpmc_try_pop, q, item, &q->items, &q->item_waiters, timeout_ms) < 0)
+        return -1;
+    signal_ev(&q->slots, &q->slot_waiters);
+    return 0;
+}
+
+int mpmc_count(mpmc_t *q)
+{
+    unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    return head > tail ? (int)(head - tail) : 0;
+}
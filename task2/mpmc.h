@@ -0,0 +1,49 @@
+/*
+ * mpmc.h - bounded lock-free multi-producer/multi-consumer queue of ints
+ *
+ * Vyukov's array queue: every cell carries a sequence number that tells
+ * producers and consumers whose turn it is, so a handoff costs one CAS on
+ * the head or tail index and no lock. mpmc_push/mpmc_pop spin a while when
+ * the queue is full/empty and then park on a futex; the spin budget adapts
+ * per thread to whether spinning has been paying off.
+ */
+#ifndef __MPMC_H__
+#define __MPMC_H__
+
+#define MPMC_LINE 64 /* keep head, tail and wakeup words on separate cache lines */
+
+typedef struct {
+    unsigned long seq;         /* pos: ready to fill, pos+1: ready to take */
+    int item;
+} mpmc_cell;
+
+typedef struct {
+    mpmc_cell *cells;
+    unsigned long mask;        /* capacity - 1, capacity a power of two */
+    unsigned long head __attribute__((aligned(MPMC_LINE))); /* next push */
+    unsigned long tail __attribute__((aligned(MPMC_LINE))); /* next pop */
+    int items __attribute__((aligned(MPMC_LINE))); /* futex: bumped per push */
+    int item_waiters;          /* consumers parked on items */
+    int slots __attribute__((aligned(MPMC_LINE))); /* futex: bumped per pop */
+    int slot_waiters;          /* producers parked on slots */
+} mpmc_t;
+
+/* n is rounded up to a power of two */
+void mpmc_init(mpmc_t *q, int n);
+void mpmc_deinit(mpmc_t *q);
+
+/* Non-blocking: 0 on success, -1 if the queue is full/empty */
+int mpmc_try_push(mpmc_t *q, int item);
+int mpmc_try_pop(mpmc_t *q, int *item);
+
+/* Blocking: spin, then park until a slot/item is available */
+void mpmc_push(mpmc_t *q, int item);
+int mpmc_pop(mpmc_t *q);
+
+/* mpmc_pop that gives up after timeout_ms: 0 and *item, or -1 */
+int mpmc_pop_timed(mpmc_t *q, int *item, int timeout_ms);
+
+/* Items queued right now; only a hint while other threads run */
+int mpmc_count(mpmc_t *q);
+
+#endif /* __MPMC_H__ */
@@ -6,6 +6,25 @@
 #define STOCK_NUM 10
 #define BUY_SELL_MAX 10
 
+/* read one length-prefixed reply ("<length>\n" + body, protocol 2) into buf */
+int read_reply(rio_t *rp, char *buf)
+{
+	int len, n, skip;
+
+	if (Rio_readlineb(rp, buf, MAXLINE) == 0)
+		return -1;
+	len = atoi(buf);
+	n = len < MAXLINE ? len : MAXLINE - 1;
+	if (Rio_readnb(rp, buf, n) != n)
+		return -1;
+	buf[n] = '\0';
+	for (skip = len - n; skip > 0; skip--) /* body longer than buf: drop the tail */
+		if (Rio_readnb(rp, &buf[n], 1) != 1)
+			return -1;
+	buf[n] = '\0';
+	return len;
+}
+
 int main(int argc, char **argv) 
 {
 	pid_t pids[MAX_CLIENT];
@@ -39,6 +58,10 @@ int main(int argc, char **argv)
 			Rio_readinitb(&rio, clientfd);
 			srand((unsigned int) getpid());
 
+			/* framed replies: only the bytes of each reply cross the wire */
+			Rio_writen(clientfd, "proto 2\n", 8);
+			read_reply(&rio, buf);
+
 			for(i=0;i<ORDER_PER_CLIENT;i++){
 				int option = rand() % 3;
 				
@@ -73,7 +96,9 @@ int main(int argc, char **argv)
 			
 				Rio_writen(clientfd, buf, strlen(buf));
 				// Rio_readlineb(&rio, buf, MAXLINE);
-				Rio_readnb(&rio, buf, MAXLINE);
+				// Rio_readnb(&rio, buf, MAXLINE);
+				if (read_reply(&rio, buf) < 0)
+					break;
 				Fputs(buf, stdout);
 
 				usleep(1000000);
@@ -0,0 +1,136 @@
+/*
+ * pool.c - elastic worker pool fed by an mpmc queue
+ */
+#include "csapp.h"
+#include "pool.h"
+#include <time.h>
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void pool_init(worker_pool *p, mpmc_t *q, void *(*routine)(void *), int min, int max, int nstamp)
+{
+    int i;
+
+    memset(p, 0, sizeof(*p));
+    p->q = q;
+    p->routine = routine;
+    p->idle_ms = POOL_IDLE_MS;
+    p->wait_ms = POOL_WAIT_MS;
+    p->min = min;
+    p->max = max;
+    p->stamp = Calloc(nstamp, sizeof(long long));
+    p->nstamp = nstamp;
+    Sem_init(&p->mutex, 0, 1);
+    for (i = 0; i < min; i++)
+        pool_spawn(p);
+}
+
+/* max ̸ ʾ worker ϳ   */
+void pool_spawn(worker_pool *p)
+{
+    pthread_t tid;
+    long idx;
+
+    P(&p->mutex);
+    if (p->live >= p->max)
+    {
+        V(&p->mutex);
+        return;
+    }
+    p->live++;
+    idx = p->spawned++;
+    if (p->live > p->peak)
+        p->peak = p->live;
+    V(&p->mutex);
+
+    __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST); /* counts as idle until its first job */
+    Pthread_create(&tid, NULL, p->routine, (void *)idx);
+}
+
+/*
+ * accept loop / poller: job q ִ´. ٸ worker   ø.
+ * The check is made again after the push: a worker whose wait timed out
+ * may have stopped counting as idle after the first one, and pool_take
+ * only sees jobs pushed before it decided to retire. Between the two
+ * sides one of them sees the other (both are seq_cst), so a job is never
+ * left behind with only busy workers.
+ */
+void pool_submit(worker_pool *p, int job)
+{
+    if (job < p->nstamp)
+        p->stamp[job] = now_us();
+    if (mpmc_count(p->q) + 1 > __atomic_load_n(&p->idle, __ATOMIC_SEQ_CST))
+        pool_spawn(p);
+    mpmc_push(p->q, job);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (mpmc_count(p->q) > __atomic_load_n(&p->idle, __ATOMIC_SEQ_CST))
+        pool_spawn(p);
+}
+
+/*
+ * worker:  job . idle_ms    min  -1
+ * (). Retiring stops counting as idle first and then looks at q once
+ * more, so a job pushed by a pool_submit that still saw this worker idle
+ * is served rather than stranded. A job that sat in q longer than wait_ms
+ * means the pool is too small for the load, so one more worker is started.
+ */
+int pool_take(worker_pool *p)
+{
+    static __thread int busy; /* returning from a job: idle again */
+    long long wait, avg, max;
+    int job;
+
+    if (busy)
+        __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+    busy = 0;
+    while (1)
+    {
+        if (mpmc_pop_timed(p->q, &job, p->idle_ms) == 0)
+        {
+            __atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        P(&p->mutex);
+        if (p->live <= p->min)
+        {
+            V(&p->mutex);
+            continue;
+        }
+        __atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (mpmc_pop_timed(p->q, &job, 0) == 0) /* one more try; wakes a blocked producer like any pop */
+        {
+            V(&p->mutex);
+            break;
+        }
+        if (mpmc_count(p->q) == 0)
+        {
+            p->live--;
+            p->retired++;
+            V(&p->mutex);
+            return -1;
+        }
+        __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST); /* a push is landing: stay */
+        V(&p->mutex);
+    }
+    busy = 1;
+
+    wait = job < p->nstamp ? now_us() - p->stamp[job] : 0;
+    avg = __atomic_load_n(&p->wait_avg_us, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&p->wait_avg_us, &avg, avg + (wait - avg) / 8, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    max = __atomic_load_n(&p->wait_max_us, __ATOMIC_RELAXED);
+    while (wait > max && !__atomic_compare_exchange_n(&p->wait_max_us, &max, wait, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    if (wait > p->wait_ms * 1000)
+        pool_spawn(p);
+    return job;
+}
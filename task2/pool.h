@@ -0,0 +1,45 @@
+/*
+ * pool.h - elastic worker pool fed by an mpmc queue
+ *
+ * Grows when more jobs wait in the queue than workers wait for them, or
+ * when a job sat there longer than wait_ms; a worker that found nothing
+ * for idle_ms retires, down to min. Jobs are ints (connfds in the server).
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <semaphore.h>
+#include "mpmc.h"
+
+#define POOL_IDLE_MS 10000 /* a worker idle this long retires (down to min) */
+#define POOL_WAIT_MS 5     /* a job that waited longer than this in the queue adds a worker */
+
+typedef struct {
+    mpmc_t *q;
+    void *(*routine)(void *);  /* thread entry, gets the worker's index; loops on pool_take */
+    int idle_ms, wait_ms;
+    int min, max;
+    int live;                  /* worker threads running */
+    int idle;                  /* waiting in q or about to (atomic) */
+    int peak;
+    long spawned, retired;
+    long long wait_avg_us;     /* queue wait, moving average (atomic) */
+    long long wait_max_us;
+    long long *stamp;          /* enqueue time per job, microseconds */
+    int nstamp;
+    sem_t mutex;               /* live, peak, spawned, retired */
+} worker_pool;
+
+/* Starts min workers; jobs below nstamp get their queue wait measured */
+void pool_init(worker_pool *p, mpmc_t *q, void *(*routine)(void *), int min, int max, int nstamp);
+
+/* One more worker unless max are running */
+void pool_spawn(worker_pool *p);
+
+/* Queue a job, adding a worker if the idle ones cannot take it */
+void pool_submit(worker_pool *p, int job);
+
+/* Next job for the calling worker, or -1 when it should retire */
+int pool_take(worker_pool *p);
+
+#endif /* __POOL_H__ */
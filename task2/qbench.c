@@ -0,0 +1,274 @@
+/*
+ * qbench.c - handoff throughput of sbuf (semaphores) vs mpmc (lock-free)
+ *
+ * usage: ./qbench [items per run]
+ * Every run pushes the same number of items through a queue of the
+ * server's size (32 slots) with P producer and C consumer threads.
+ *
+ * usage: ./qbench retire [trials]
+ * Regression case for the worker pool (pool.c): min 1 worker pinned by a
+ * long-lived client, and a connect that lands right when the only other
+ * worker's idle wait runs out. It must be served by that worker or a new
+ * one, never left queued until the pinned client leaves.
+ */
+#include "csapp.h"
+#include "sbuf.h"
+#include "mpmc.h"
+#include "pool.h"
+#include <time.h>
+
+#define QSIZE 32
+#define DEFAULT_ITEMS 2000000
+#define DONE -1 /* one per consumer after the producers finish */
+
+#define RETIRE_TRIALS 200
+#define RETIRE_IDLE_MS 20 /* the pool's idle_ms for the retire case */
+#define RETIRE_SPREAD_US 3000 /* connects land idle_ms - spread/2 .. + spread/2 after the worker went idle */
+#define RETIRE_WAIT_MS 1000 /* a connect not served by then is stranded */
+#define JOB_PIN 0 /* long-lived client: holds its worker until unpin */
+#define JOB_PROBE 1 /* short connection */
+#define JOB_STOP 2 /* the worker exits (the pool is thrown away after the trial) */
+
+typedef struct {
+    int kind; /* 0: sbuf, 1: mpmc */
+    sbuf_t sb;
+    mpmc_t mq;
+    long per_producer;
+    long sum; /* consumers add what they took; checked against the expected sum */
+} bench_t;
+
+static void q_put(bench_t* b, int item)
+{
+    if (b->kind == 0)
+        sbuf_insert(&b->sb, item);
+    else
+        mpmc_push(&b->mq, item);
+}
+
+static int q_get(bench_t* b)
+{
+    return b->kind == 0 ? sbuf_remove(&b->sb) : mpmc_pop(&b->mq);
+}
+
+static void* producer(void* vargp)
+{
+    bench_t* b = vargp;
+    long k;
+
+    for (k = 0; k < b->per_producer; k++)
+        q_put(b, (int)(k & 0xffff));
+    return NULL;
+}
+
+static void* consumer(void* vargp)
+{
+    bench_t* b = vargp;
+    long sum = 0;
+    int item;
+
+    while ((item = q_get(b)) != DONE)
+        sum += item;
+    __atomic_add_fetch(&b->sum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*   run: ó(items/s) ȯѴ */
+static double run(int kind, int np, int nc, long items)
+{
+    bench_t b;
+    pthread_t tid[256];
+    long k, expect = 0;
+    double t;
+    int i;
+
+    b.kind = kind;
+    b.per_producer = items / np;
+    b.sum = 0;
+    if (kind == 0)
+        sbuf_init(&b.sb, QSIZE);
+    else
+        mpmc_init(&b.mq, QSIZE);
+
+    t = now_sec();
+    for (i = 0; i < nc; i++)
+        Pthread_create(&tid[np + i], NULL, consumer, &b);
+    for (i = 0; i < np; i++)
+        Pthread_create(&tid[i], NULL, producer, &b);
+    for (i = 0; i < np; i++)
+        Pthread_join(tid[i], NULL);
+    for (i = 0; i < nc; i++)
+        q_put(&b, DONE);
+    for (i = 0; i < nc; i++)
+        Pthread_join(tid[np + i], NULL);
+    t = now_sec() - t;
+
+    for (k = 0; k < b.per_producer; k++)
+        expect += k & 0xffff;
+    if (b.sum != expect * np)
+        app_error("qbench: items lost or duplicated");
+
+    if (kind == 0)
+        sbuf_deinit(&b.sb);
+    else
+        mpmc_deinit(&b.mq);
+    return b.per_producer * np / t;
+}
+
+static worker_pool rpool;
+static sem_t pinned, unpin, served, stopped;
+static long long probe_done_us; /* when the last probe finished: its worker is idle from here */
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void* retire_worker(void* vargp)
+{
+    int job;
+
+    Pthread_detach(pthread_self());
+    while ((job = pool_take(&rpool)) >= 0)
+    {
+        if (job == JOB_PIN)
+        {
+            V(&pinned);
+            P(&unpin);
+        }
+        else if (job == JOB_PROBE)
+        {
+            probe_done_us = now_us();
+            V(&served);
+        }
+        else
+        {
+            V(&stopped);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* served RETIRE_WAIT_MS ٸ: 0, or -1 if the probe is stranded */
+static int wait_served(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += RETIRE_WAIT_MS / 1000;
+    ts.tv_nsec += (RETIRE_WAIT_MS % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(&served, &ts) < 0)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+/*
+ *   trial: worker A long-lived client , probe ϳ worker B
+ *  , B  ϰ idle_ms + offset_us ڿ  probe ִ´.
+ * Returns 1 if that probe was stranded.
+ */
+static int retire_trial(long offset_us)
+{
+    mpmc_t q;
+    long long at;
+    int stranded = 0, n;
+
+    mpmc_init(&q, QSIZE);
+    pool_init(&rpool, &q, retire_worker, 0, 2, 0);
+    rpool.min = 1; /* A is spawned by the first submit, after idle_ms is set */
+    rpool.idle_ms = RETIRE_IDLE_MS;
+
+    pool_submit(&rpool, JOB_PIN);
+    P(&pinned);
+    pool_submit(&rpool, JOB_PROBE); /* nobody idle: spawns B */
+    if (wait_served() < 0)
+        app_error("qbench: first probe not served");
+
+    at = probe_done_us + RETIRE_IDLE_MS * 1000LL + offset_us;
+    while (now_us() < at)
+        ;
+    pool_submit(&rpool, JOB_PROBE);
+    if (wait_served() < 0)
+    {
+        stranded = 1;
+        V(&unpin); /* A picks the probe up now */
+        if (wait_served() < 0)
+            app_error("qbench: probe lost");
+    }
+    else
+        V(&unpin);
+
+    P(&rpool.mutex);
+    n = rpool.live;
+    V(&rpool.mutex);
+    while (n-- > 0)
+    {
+        mpmc_push(&q, JOB_STOP);
+        P(&stopped);
+    }
+    mpmc_deinit(&q);
+    Free(rpool.stamp);
+    return stranded;
+}
+
+static void retire_bench(int trials)
+{
+    int i, stranded = 0, retired = 0;
+    long offset;
+
+    Sem_init(&pinned, 0, 0);
+    Sem_init(&unpin, 0, 0);
+    Sem_init(&served, 0, 0);
+    Sem_init(&stopped, 0, 0);
+    for (i = 0; i < trials; i++)
+    {
+        offset = -RETIRE_SPREAD_US / 2 + (long)RETIRE_SPREAD_US * i / trials;
+        stranded += retire_trial(offset);
+        retired += rpool.retired > 0;
+    }
+    printf("retire race: %d trials, idle %dms, connect at idle %+.1f..%+.1fms: "
+        "%d served after the worker retired, %d stranded\n",
+        trials, RETIRE_IDLE_MS, -RETIRE_SPREAD_US / 2000.0, RETIRE_SPREAD_US / 2000.0, retired, stranded);
+    if (stranded > 0)
+        app_error("qbench: a connection waited for a busy worker while the pool could grow");
+}
+
+int main(int argc, char** argv)
+{
+    static const int conf[][2] = { {1, 1}, {1, 4}, {1, 16}, {1, 100}, {4, 4}, {8, 8}, {16, 100} };
+    long items = argc > 1 ? atol(argv[1]) : DEFAULT_ITEMS;
+    double s, m;
+    int i;
+
+    if (argc > 1 && strcmp(argv[1], "retire") == 0)
+    {
+        retire_bench(argc > 2 ? atoi(argv[2]) : RETIRE_TRIALS);
+        exit(0);
+    }
+
+    printf("%-10s %-10s %14s %14s %8s\n", "producers", "consumers", "sbuf items/s", "mpmc items/s", "speedup");
+    for (i = 0; i < (int)(sizeof(conf) / sizeof(conf[0])); i++)
+    {
+        s = run(0, conf[i][0], conf[i][1], items);
+        m = run(1, conf[i][0], conf[i][1], items);
+        printf("%-10d %-10d %14.0f %14.0f %7.1fx\n", conf[i][0], conf[i][1], s, m, m / s);
+    }
+    exit(0);
+}
@@ -0,0 +1,27 @@
+/*
+ * sbuf.h - CS:APP semaphore-based bounded buffer of ints
+ *
+ * The server now hands connections to workers through mpmc.h; sbuf is
+ * kept as the baseline for qbench.
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+typedef struct {
+    int* buf; /*  迭 */
+    int n; /*  ִ  */
+    int front; /* ù° item = buf[(front+1)%n] */
+    int rear; /*  item = buf[rear%n] */
+    sem_t mutex; /* ۿ   ȣѴ */
+    sem_t slots; /* available slot  */
+    sem_t items; /* available item  */
+} sbuf_t;
+
+void sbuf_init(sbuf_t* sp, int n);
+void sbuf_deinit(sbuf_t* sp);
+void sbuf_insert(sbuf_t* sp, int item);
+int sbuf_remove(sbuf_t* sp);
+
+#endif /* __SBUF_H__ */
@@ -0,0 +1,190 @@
+/*
+ * skiplist.c - lock-free ordered set of int keys (Herlihy/Shavit skip list)
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "skiplist.h"
+
+#define MARKED(p) ((uintptr_t)(p) & 1)
+#define MARK(p)   ((sl_node *)((uintptr_t)(p) | 1))
+#define UNMARK(p) ((sl_node *)((uintptr_t)(p) & ~(uintptr_t)1))
+
+static __thread unsigned long rnd; /* xorshift state per thread */
+
+/* 1 + the number of coin flips that came up heads: level k with p = 2^-k */
+static int random_height(void)
+{
+    int h = 1;
+
+    if (rnd == 0)
+        rnd = (unsigned long)(uintptr_t)&rnd * 0x9E3779B97F4A7C15UL | 1;
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    while (h < SL_MAX && (rnd >> (h - 1) & 1))
+        h++;
+    return h;
+}
+
+void sl_init(skiplist *l)
+{
+    memset(l, 0, sizeof(*l));
+    l->head.height = SL_MAX;
+    l->head.linked = 1;
+    l->head.next = l->head_next;
+}
+
+void *sl_alloc(size_t size)
+{
+    sl_node *n;
+    void *p;
+    int h = random_height();
+
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (posix_memalign(&p, SL_LINE, size + h * sizeof(sl_node *)) != 0)
+        abort();
+    memset(p, 0, size + h * sizeof(sl_node *));
+    n = p;
+    n->height = h;
+    n->next = (sl_node **)((char *)p + size);
+    return p;
+}
+
+void sl_free(void *n)
+{
+    free(n);
+}
+
+/*
+ * preds[lv]/succs[lv]: the last node below key and the first at or above
+ * it on every level. Marked nodes met on the way are cut out; if a cut
+ * fails, pred itself changed or is being removed, so start over.
+ * Returns 1 if succs[0] has key.
+ */
+static int find(skiplist *l, int key, sl_node **preds, sl_node **succs)
+{
+    sl_node *pred, *curr, *succ;
+    int lv;
+
+retry:
+    pred = &l->head;
+    for (lv = SL_MAX - 1; lv >= 0; lv--) {
+        curr = UNMARK(__atomic_load_n(&pred->next[lv], __ATOMIC_ACQUIRE));
+        while (curr != NULL) {
+            succ = __atomic_load_n(&curr->next[lv], __ATOMIC_ACQUIRE);
+            if (MARKED(succ)) {
+                sl_node *expect = curr;
+
+                if (!__atomic_compare_exchange_n(&pred->next[lv], &expect, UNMARK(succ), 0,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                    goto retry;
+                curr = UNMARK(succ);
+                continue;
+            }
+            if (curr->key >= key)
+                break;
+            pred = curr;
+            curr = succ;
+        }
+        preds[lv] = pred;
+        succs[lv] = curr;
+    }
+    return succs[0] != NULL && succs[0]->key == key;
+}
+
+sl_node *sl_find(skiplist *l, int key)
+{
+    sl_node *pred = &l->head, *curr = NULL, *succ;
+    int lv;
+
+    for (lv = SL_MAX - 1; lv >= 0; lv--) {
+        curr = UNMARK(__atomic_load_n(&pred->next[lv], __ATOMIC_ACQUIRE));
+        while (curr != NULL) {
+            succ = __atomic_load_n(&curr->next[lv], __ATOMIC_ACQUIRE);
+            if (MARKED(succ)) {     /* step over a node being removed */
+                curr = UNMARK(succ);
+                continue;
+            }
+            if (curr->key >= key)
+                break;
+            pred = curr;
+            curr = succ;
+        }
+    }
+    return curr != NULL && curr->key == key ? curr : NULL;
+}
+
+/*
+ * Level 0 decides membership: once n is linked there it is in the set.
+ * The upper levels are only shortcuts and are linked afterwards, each
+ * retried against fresh preds/succs until its CAS lands. Nobody removes
+ * n before linked is set, so its own next pointers are ours until then.
+ */
+int sl_insert(skiplist *l, sl_node *n)
+{
+    sl_node *preds[SL_MAX], *succs[SL_MAX], *expect;
+    int lv;
+
+    while (1) {
+        if (find(l, n->key, preds, succs))
+            return -1;
+        for (lv = 0; lv < n->height; lv++)
+            __atomic_store_n(&n->next[lv], succs[lv], __ATOMIC_RELAXED);
+        expect = succs[0];
+        if (__atomic_compare_exchange_n(&preds[0]->next[0], &expect, n, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            break;
+    }
+    for (lv = 1; lv < n->height; lv++) {
+        while (1) {
+            expect = succs[lv];
+            if (__atomic_compare_exchange_n(&preds[lv]->next[lv], &expect, n, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                break;
+            find(l, n->key, preds, succs);
+            __atomic_store_n(&n->next[lv], succs[lv], __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&n->linked, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Mark the upper levels top-down, then level 0; whoever marks level 0
+ * owns the removal. The closing find cuts n out of every level: n is
+ * marked everywhere, and a new node with the same key is only linked
+ * past the point where n was already cut.
+ */
+int sl_remove(skiplist *l, sl_node *n)
+{
+    sl_node *preds[SL_MAX], *succs[SL_MAX], *succ;
+    int lv;
+
+    for (lv = n->height - 1; lv >= 1; lv--) {
+        succ = __atomic_load_n(&n->next[lv], __ATOMIC_ACQUIRE);
+        while (!MARKED(succ))
+            __atomic_compare_exchange_n(&n->next[lv], &succ, MARK(succ), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    succ = __atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE);
+    while (1) {
+        if (MARKED(succ))
+            return -1;
+        if (__atomic_compare_exchange_n(&n->next[0], &succ, MARK(succ), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+    find(l, n->key, preds, succs);
+    return 0;
+}
+
+sl_node *sl_first(skiplist *l)
+{
+    return sl_next(&l->head);
+}
+
+sl_node *sl_next(sl_node *n)
+{
+    return UNMARK(__atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE));
+}
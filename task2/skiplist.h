@@ -0,0 +1,54 @@
+/*
+ * skiplist.h - lock-free ordered set of int keys (Herlihy/Shavit skip list)
+ *
+ * Nodes are intrusive: the caller's struct starts with an sl_node and is
+ * allocated with sl_alloc. Lookups never write; inserts link a node level
+ * by level with CAS, and a removal marks the node's next pointers and lets
+ * every traversal that meets it cut it out. No call takes a lock.
+ *
+ * A removed node may still be read by traversals that started before
+ * sl_remove returned. Freeing it is the caller's job, once all of those
+ * are known to be done.
+ */
+#ifndef __SKIPLIST_H__
+#define __SKIPLIST_H__
+
+#include <stddef.h>
+
+#define SL_MAX  24         /* levels; p = 1/2 keeps 2^24 keys at O(log n) */
+#define SL_LINE 64
+
+typedef struct sl_node {
+    int key;
+    int height;                /* levels it is linked at, 1..SL_MAX */
+    int linked;                /* every level linked (atomic); only then removable */
+    struct sl_node **next;     /* next[0..height-1]; low bit set = being removed */
+} sl_node;
+
+typedef struct {
+    sl_node head;              /* before every key */
+    sl_node *head_next[SL_MAX];
+} skiplist;
+
+void sl_init(skiplist *l);
+
+/* size bytes of the caller's struct plus a random number of levels after
+ * it, cache line aligned. The key is set by the caller. */
+void *sl_alloc(size_t size);
+void sl_free(void *n);
+
+/* The node with key, or NULL; marked nodes count as absent */
+sl_node *sl_find(skiplist *l, int key);
+
+/* 0 once n is in the set, -1 if key is already there (n is untouched) */
+int sl_insert(skiplist *l, sl_node *n);
+
+/* 0 if this call removed n and it is unlinked from every level, -1 if
+ * another call removed it first. n->linked must be set. */
+int sl_remove(skiplist *l, sl_node *n);
+
+/* In key order, removed nodes included (the caller filters them) */
+sl_node *sl_first(skiplist *l);
+sl_node *sl_next(sl_node *n);
+
+#endif /* __SKIPLIST_H__ */
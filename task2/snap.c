@@ -0,0 +1,130 @@
+/*
+ * snap.c - global version clock and reservations for point-in-time snapshots
+ */
+#include <stdint.h>
+#include <sched.h>
+#include "snap.h"
+
+#define SLOT_FREE    (~0UL)     /* both above any timestamp, so snap_horizon skips them */
+#define SLOT_CLAIMED (~0UL - 1) /* taken, not yet announced */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static unsigned long clock_ts __attribute__((aligned(SNAP_LINE))); /* last timestamp handed out */
+static unsigned long stable __attribute__((aligned(SNAP_LINE)));   /* every ts <= stable is done */
+static unsigned long done[SNAP_RING] __attribute__((aligned(SNAP_LINE))); /* done[ts % ring] = ts */
+static unsigned long slots[SNAP_SLOTS] __attribute__((aligned(SNAP_LINE)));
+static __thread unsigned int slot_hint; /* where this thread found a free slot last */
+
+/* the thread we wait for may be preempted: spin a little, then yield */
+static void backoff(int *spins)
+{
+    if (++*spins % 64 == 0)
+        sched_yield();
+    else
+        cpu_relax();
+}
+
+void snap_init(void)
+{
+    int i;
+
+    for (i = 0; i < SNAP_SLOTS; i++)
+        slots[i] = SLOT_FREE;
+    clock_ts = stable = 0; /* timestamp 0: the versions loaded at startup */
+}
+
+/*
+ * The announcement is stable read before the slot is set, and the snapshot
+ * is stable read after. A snap_horizon that missed the slot read stable
+ * before the slot was set, so its result is <= *snap either way.
+ */
+int snap_enter(unsigned long *snap)
+{
+    unsigned long expect;
+    unsigned int i;
+    int spins = 0;
+
+    if (slot_hint == 0)
+        slot_hint = (unsigned int)((uintptr_t)&slot_hint >> 6) | 1; /* spread threads over the slots */
+    i = slot_hint % SNAP_SLOTS;
+    while (1) {
+        expect = SLOT_FREE;
+        if (__atomic_load_n(&slots[i], __ATOMIC_RELAXED) == SLOT_FREE &&
+            __atomic_compare_exchange_n(&slots[i], &expect, SLOT_CLAIMED, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+        i = (i + 1) % SNAP_SLOTS;
+        backoff(&spins);
+    }
+    slot_hint = i | SNAP_SLOTS; /* nonzero even for slot 0 */
+    __atomic_store_n(&slots[i], __atomic_load_n(&stable, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    *snap = __atomic_load_n(&stable, __ATOMIC_SEQ_CST);
+    return i;
+}
+
+/*
+ * A newer snapshot than the one announced is safe to read: versions are
+ * freed only below the announcement. The writes waited for are between
+ * snap_tick and snap_done, which never waits on a reader.
+ */
+int snap_enter_latest(unsigned long *snap)
+{
+    unsigned long ts;
+    int slot = snap_enter(snap), spins = 0;
+
+    ts = __atomic_load_n(&clock_ts, __ATOMIC_SEQ_CST);
+    while ((*snap = __atomic_load_n(&stable, __ATOMIC_ACQUIRE)) < ts && spins < SNAP_WAIT)
+        backoff(&spins);
+    return slot;
+}
+
+void snap_exit(int slot)
+{
+    __atomic_store_n(&slots[slot], SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+unsigned long snap_tick(void)
+{
+    unsigned long ts = __atomic_add_fetch(&clock_ts, 1, __ATOMIC_SEQ_CST);
+    int spins = 0;
+
+    /* done[ts % ring] is free again once stable has passed ts - ring */
+    while (ts - __atomic_load_n(&stable, __ATOMIC_ACQUIRE) > SNAP_RING)
+        backoff(&spins);
+    return ts;
+}
+
+/* Mark ts done, then move stable over every done timestamp that follows it */
+void snap_done(unsigned long ts)
+{
+    unsigned long s;
+
+    __atomic_store_n(&done[ts % SNAP_RING], ts, __ATOMIC_RELEASE);
+    s = __atomic_load_n(&stable, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&done[(s + 1) % SNAP_RING], __ATOMIC_ACQUIRE) == s + 1) {
+        if (__atomic_compare_exchange_n(&stable, &s, s + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+            s++;                    /* on failure s is the newer stable */
+    }
+}
+
+unsigned long snap_horizon(void)
+{
+    unsigned long m = __atomic_load_n(&stable, __ATOMIC_SEQ_CST), v;
+    int i;
+
+    for (i = 0; i < SNAP_SLOTS; i++)
+        if ((v = __atomic_load_n(&slots[i], __ATOMIC_SEQ_CST)) < m)
+            m = v;
+    return m;
+}
+
+unsigned long snap_stable(void)
+{
+    return __atomic_load_n(&stable, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,48 @@
+/*
+ * snap.h - global version clock and reservations for point-in-time snapshots
+ *
+ * Every write takes a timestamp from one clock (snap_tick) and reports it
+ * finished (snap_done) once its new version is published, whether or not
+ * it succeeded. The stable timestamp is the highest one below which every
+ * write has finished, so reading "the newest version at or below stable"
+ * of every object gives one consistent point in time without stopping
+ * anyone.
+ *
+ * Readers, and writers that read the current version, hold a reservation
+ * between snap_enter and snap_exit. A version may be freed once a newer
+ * version of the same object is at or below snap_horizon(): no current or
+ * future reservation can reach past that one.
+ */
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#define SNAP_LINE 64
+#define SNAP_SLOTS 64      /* reservations held at once; more callers wait */
+#define SNAP_RING 65536    /* writes in flight beyond stable; more writers wait */
+#define SNAP_WAIT 256      /* snap_enter_latest backoff rounds before it settles for stable */
+
+void snap_init(void);
+
+/* Reserve and return the slot; *snap = the timestamp to read at */
+int snap_enter(unsigned long *snap);
+void snap_exit(int slot);
+
+/* snap_enter, but waits until every write that took its timestamp
+ * before the call is done, so the caller sees its own earlier writes.
+ * The wait is bounded: if a writer is stuck between snap_tick and
+ * snap_done (preempted), it returns the stable snapshot instead, which
+ * is consistent but may miss writes that finished after the stuck one
+ * started. */
+int snap_enter_latest(unsigned long *snap);
+
+/* Timestamp for one write attempt; every one must be passed to snap_done */
+unsigned long snap_tick(void);
+void snap_done(unsigned long ts);
+
+/* Oldest timestamp any reservation may read at */
+unsigned long snap_horizon(void);
+
+/* For stats */
+unsigned long snap_stable(void);
+
+#endif /* __SNAP_H__ */
@@ -0,0 +1,52 @@
+/*
+ * spsc.c - bounded lock-free single-producer/single-consumer channel
+ */
+#include <stdlib.h>
+#include "spsc.h"
+
+void spsc_init(spsc_t *q, int n)
+{
+    unsigned long cap = 1;
+
+    while (cap < (unsigned long)n)
+        cap <<= 1;
+    q->slots = malloc(cap * sizeof(spsc_msg));
+    if (q->slots == NULL)
+        abort();
+    q->mask = cap - 1;
+    q->head = q->tail = 0;
+    q->head_cache = q->tail_cache = 0;
+}
+
+void spsc_deinit(spsc_t *q)
+{
+    free(q->slots);
+}
+
+int spsc_try_push(spsc_t *q, const spsc_msg *m)
+{
+    unsigned long head = q->head;
+
+    if (head - q->tail_cache > q->mask) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head - q->tail_cache > q->mask)
+            return -1;              /* full */
+    }
+    q->slots[head & q->mask] = *m;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int spsc_try_pop(spsc_t *q, spsc_msg *m)
+{
+    unsigned long tail = q->tail;
+
+    if (tail == q->head_cache) {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail == q->head_cache)
+            return -1;              /* empty */
+    }
+    *m = q->slots[tail & q->mask];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
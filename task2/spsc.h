@@ -0,0 +1,39 @@
+/*
+ * spsc.h - bounded lock-free single-producer/single-consumer channel
+ *
+ * Exactly one thread pushes and one thread pops, so each index has a
+ * single writer and a handoff is one release store, no CAS. Each side
+ * also keeps a private copy of the other side's index and only rereads
+ * the shared one when the copy says the ring is full/empty, so the two
+ * cache lines bounce once per batch instead of once per message.
+ */
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+#define SPSC_LINE 64
+
+typedef struct {               /* an order, or the reply to it */
+    void *tag;                 /* who is waiting for the reply */
+    int op;
+    int id;
+    int num;                   /* quantity; the result in a reply */
+} spsc_msg;
+
+typedef struct {
+    spsc_msg *slots;
+    unsigned long mask;        /* capacity - 1, capacity a power of two */
+    unsigned long head __attribute__((aligned(SPSC_LINE))); /* next push, producer only */
+    unsigned long tail_cache;  /* producer's copy of tail */
+    unsigned long tail __attribute__((aligned(SPSC_LINE))); /* next pop, consumer only */
+    unsigned long head_cache;  /* consumer's copy of head */
+} spsc_t;
+
+/* n is rounded up to a power of two */
+void spsc_init(spsc_t *q, int n);
+void spsc_deinit(spsc_t *q);
+
+/* 0 on success, -1 if the channel is full/empty */
+int spsc_try_push(spsc_t *q, const spsc_msg *m);
+int spsc_try_pop(spsc_t *q, spsc_msg *m);
+
+#endif /* __SPSC_H__ */
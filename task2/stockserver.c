@@ -3,372 +3,2068 @@
  */ 
 /* $begin echoserverimain */
 #include "csapp.h"
-#define NTHREADS 100
-#define SBUFSIZE 32
+#include "timer.h"
+#include "mpmc.h"
+#include "pool.h"
+#include "spsc.h"
+#include "snap.h"
+#include "skiplist.h"
+#include "idtab.h"
+#include "affinity.h"
+#include "coro.h"
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#define NTHREADS_MIN 16 /* default worker pool bounds, thread mode */
+#define NTHREADS_MAX 1024
+#define HYBRID_MIN 2 /* default worker pool bounds, hybrid mode */
+#define HYBRID_MAX 64
+#define CONNQ_SIZE 32 /* slots in the accept-to-worker queue */
+#define JOBQ_SIZE 4096 /* hybrid mode: connq holds connections with complete lines */
+#define MAXCONN_HYBRID 65536
+#define HYBRID_EVENTS 256
+
+#define MODE_THREAD 0 /* one worker per connection */
+#define MODE_HYBRID 1 /* epoll poller owns connections, workers run commands */
+#define MODE_CORO   2 /* one coroutine per connection on a few scheduler threads */
+#define CORO_MAXSCHED 64
+#define SHARD_MAX 64
+#define SHARDQ_SIZE 1024 /* slots per scheduler-shard channel, each way */
+
+#define CMD_REPLY  0 /* run_command: send printbuf */
+#define CMD_EXIT   1 /* send printbuf, then close */
+#define CMD_SILENT 2 /* nothing to send (unknown command, legacy protocol) */
+#define PROTO_LEGACY 1 /* every reply is padded to MAXLINE bytes */
+#define PROTO_FRAMED 2 /* every reply is "<length>\n" followed by length bytes */
+#define STATS_WINDOW 1.0 /* seconds per accept-rate sample */
+
+#define TIMER_TICK_MS 100 /* timer wheel resolution */
+#define TM_IDLE    0 /* waiting for the next command */
+#define TM_REQUEST 1 /* part of a command line buffered, waiting for the rest */
+#define TM_WRITE   2 /* running a command and sending its reply */
+
+/*
+ *  timer. ɸ ٲ  deadline ϳ̶  thread lock 
+ * , wheel node timer thread deadline ȮϷ   δ.
+ */
+typedef struct {
+    tnode node; /* first: the wheel hands it back to expire_conn; id = fd */
+    unsigned long deadline; /* (ms << 2) | TM_* kind, 0 = none (atomic) */
+} ctimer;
+
+/* glibc declares accept4 only under _GNU_SOURCE, which clashes with csapp.h's gai_error */
+extern int accept4(int sockfd, struct sockaddr* addr, socklen_t* addrlen, int flags);
 /***** Prethreaded server  *****/
 
-typedef struct {
-    int* buf; /*  迭 */
-    int n; /*  ִ  */
-    int front; /* ù° item = buf[(front+1)%n] */
-    int rear; /*  item = buf[rear%n] */
-    sem_t mutex; /* ۿ   ȣѴ */
-    sem_t slots; /* available slot  */
-    sem_t items; /* available item  */
-} sbuf_t;
-
-sbuf_t sbuf; /* Shared buffer of connected descriptors */
-
-static int byte_cnt; /* counter for total bytes received by all threads */
-static sem_t mutex; /* and the mutex that protects it */
-
-void sbuf_init(sbuf_t* sp, int n);
-void sbuf_deinit(sbuf_t* sp);
-void sbuf_insert(sbuf_t* sp, int item);
-int sbuf_remove(sbuf_t* sp);
-
-void* thread(void* vargp);
-static void init_echo_cnt(void);
+mpmc_t connq; /* Shared lock-free queue of connected descriptors */
+
+static int byte_cnt; /* counter for total bytes received by all threads (atomic) */
+
+
 void echo_cnt(int connfd);
+void clear_printbuf(void);
+
+#define CONN_SLAB 64 /* conn objects carved from one allocation */
+
+typedef struct conn { /*  ϳ : slab Ҵϰ free list Ѵ */
+    int fd;
+    int proto; /* PROTO_LEGACY or PROTO_FRAMED */
+    rio_t rio;
+    char buf[MAXLINE]; /*    */
+    ctimer timer;
+    struct conn* next; /* free list link */
+} conn;
+
+conn* conn_freelist; /* ݳ conn */
+sem_t conn_mutex; /* conn_freelist conn_inuse, conn_bytes ȣѴ */
+long conn_inuse; /* conns handed to workers */
+long conn_bytes; /* slab memory, never returned */
+
+conn* conn_alloc(void);
+void conn_release(conn* c);
+void show_mem(void);
+int send_reply(int connfd, int proto);
+int format_reply(char* out, int proto);
+int run_command(int connfd, char* line, int* proto);
+void log_received(int connfd, int n);
+
+/*
+ * hybrid mode  . poller worker  Ѵ: fd EPOLLONESHOT
+ * ϵǾ ִ  poller, ϼ  ־ connq  ڿ  worker
+ * ٽ   ϹǷ lock ʿ .
+ */
+typedef struct {
+    int fd;
+    int proto;
+    int eof; /* peer closed: run what is buffered, then close */
+    char* inbuf; /* MAXLINE bytes, allocated only while input is buffered */
+    int inlen;
+    ctimer timer;
+} hconn;
+
+int mode = MODE_THREAD;
+int epfd; /* hybrid poller */
+hconn** hconns; /* indexed by fd */
+int hmax; /* size of the fd-indexed tables: hconns, workers.stamp */
+long hconn_cnt, hinbuf_cnt; /* "stats mem", atomic */
+
+void hybrid_add(int connfd);
+void hybrid_read(hconn* c);
+void hybrid_serve(hconn* c);
+void hybrid_close(hconn* c);
+void hybrid_rearm(hconn* c);
+void hybrid_loop(int listenfd);
+int default_maxconn(void);
+
+/*
+ * coroutine mode  .   echo_cntó   
+ * I/O ٸ  scheduler ưǷ,  ϳ  structŭ
+ * ޸( Ͱ ִ  ) . Only its scheduler thread touches it.
+ */
+typedef struct session {
+    coro_t co;
+    int fd;
+    int proto;
+    int eof;
+    int rc; /* CMD_* of the command being answered */
+    int wait; /* CO_READ, CO_WRITE or CO_CALL: what resumes it */
+    char* inbuf; /* MAXLINE bytes, allocated only while input is buffered */
+    int inlen;
+    char* out; /* reply the socket did not take at once */
+    int outlen, outoff;
+    ctimer timer;
+    int op, id, num; /* shard mode: the order in flight; num is the result once answered */
+    struct session* next; /* scheduler backlog link */
+} session;
+
+typedef struct { /* scheduler thread: ڱ epoll set session  */
+    int epfd;
+    int idx;
+    int efd; /* shard mode: shards ring it when replies are waiting */
+    unsigned long long ring; /* shards given orders since they were last rung */
+    session* backlog; /* orders whose channel was full, oldest first */
+    session* backlog_tail;
+} coro_sched;
+
+coro_sched scheds[CORO_MAXSCHED];
+int nscheds;
+long session_cnt, sinbuf_cnt; /* "stats mem", atomic */
+
+int session_run(session* s);
+void* sched_thread(void* vargp);
+void coro_add(int connfd);
+void session_close(session* s);
+
+#define OP_BUY  1
+#define OP_SELL 2
+#define ORDER_OK      0
+#define ORDER_SHORT   1 /* not enough left stock */
+#define ORDER_NOSTOCK 2 /* no such stock ID */
+
+/*
+ * shard mode (-s, coro):  ID % nshards == idx   shard thread idx
+ * ϳ Ѵ. scheduler buy/sell  shard  SPSC channel ְ
+ * session , shard  ƿ channel ־ session .
+ * 񸶴 ֹϴ writer ϳ̹Ƿ buy/sell CAS list/delist
+ * ĥ  ϰ,  cache line thread ̸  ʴ´.
+ */
+typedef struct {
+    int idx;
+    int efd; /* doorbell: schedulers ring it after queueing orders */
+    long orders; /* executed so far (atomic) */
+} shard;
+
+shard shards[SHARD_MAX];
+int nshards; /* 0 = off */
+spsc_t* orderq; /* [sched * nshards + shard]: scheduler -> shard */
+spsc_t* replyq; /* [shard * nscheds + sched]: shard -> scheduler */
+
+void shard_init(void);
+void* shard_thread(void* vargp);
+void shard_exec(spsc_msg* m);
+void shard_send(coro_sched* sc, session* s);
+void sched_flush(coro_sched* sc);
+void sched_replies(coro_sched* sc);
+
+worker_pool workers; /* elastic: connq и ø,   worker Ѵ */
+
+int cpus[CPU_LIST_MAX]; /* -a: cpus[0] accept/poller + timer, workers round-robin over the rest */
+int ncpus; /* 0 = let the scheduler place threads */
+
+void pin_thread(const char* who, int idx);
+
+void* worker(void* vargp);
+void show_pool(char* buf);
+
+int timeout[3] = { 300, 30, 60 }; /* seconds per TM_* kind, 0 = never */
+twheel wheel; /*  worker  timer */
+sem_t wheel_mutex; /* wheel ȣѴ: Ḷ ְ   timer thread ´ */
+unsigned long tm_now; /* clock in ms, published by the timer thread every tick (atomic) */
+unsigned tm_recheck; /* ms between deadline checks: the shortest nonzero timeout */
+
+void* timer_thread(void* vargp);
+void expire_conn(tnode* t, void* arg);
+void conn_timer_init(ctimer* t, int fd);
+void conn_timer(ctimer* t, int kind);
+void conn_timer_del(ctimer* t);
+
+
+typedef struct { /*  : main thread ϰ worker д´ */
+    double start; /* CLOCK_MONOTONIC seconds at startup */
+    long accepted; /* connections accepted so far */
+    long maxbatch; /* most connections accepted on one readiness event */
+    double win_start; /* current accept-rate window */
+    long win_cnt;
+    double win_rate; /* accepts/s over the last full window */
+    long timeouts[3]; /* connections shut down per TM_* kind */
+    sem_t mutex;
+} server_stats;
+
+server_stats stats;
+
+double now_sec(void);
+void init_stats(void);
+void stats_accepted(int batch);
+void show_stats(void);
+void stats_timeout(int kind);
+int accept_clients(int listenfd);
 
 
 /***** ֽ   *****/
 
-char printbuf[MAXLINE]; /*   ϱ  迭 */
+__thread char printbuf[MAXLINE]; /*   ϱ  迭 (worker ϳ) */
 
-typedef struct item { /* ֽ item */
-    int ID;
-    int left_stock;
+#define STOCK_LINE 64 /* cache line */
+#define STOCK_GONE -1 /* left_stock of the version that delists a stock */
+
+/*
+ * ܷ version ϳ. ֹ ܷ   ʰ  version head CAS Ǵ.
+ *  version װ   ִ snapshot     writer .
+ * list/delist version̶,   snapshot   δ.
+ */
+typedef struct stock_ver {
+    int left_stock; /* STOCK_GONE: delisted */
     int price;
-    int readcnt; /* Initially = 0 */
-    sem_t mutex, w; /* Initially = 1 */
-}item;
-
-typedef struct node* node_pointer;
-typedef struct node { /* Ʈ  */
-    item stock;
-    node_pointer left_child;
-    node_pointer right_child;
-}node;
-
-node_pointer root = NULL; /* Ʈ */
-
-node_pointer create_node(item stock); /*   */
-node_pointer insert_node(node_pointer root, item stock); /* Ʈ   */
-node_pointer read_stock(); /* stock.txt о binary tree · Ѵ */
-void write_inorder(node_pointer root, FILE* fp);
-void write_stock(node_pointer root); /*  ֽ ¸ stock.txt  */
-
-void show_stock(int connfd, node_pointer root); /*  ֽ ¸ ش */
-struct node* tree_search(node_pointer root, int id); /* Ʈ id  带 ã ȯ */
-void buy_stock(int connfd, int id, int num, node_pointer root); /* ֽ  */
-void sell_stock(int connfd, int id, int num, node_pointer root); /* ֽ Ǹ */
+    unsigned long ts; /* snap clock when the order took effect, 0 = loaded at startup */
+    struct stock_ver* prev; /* older version (atomic: the pruner cuts it) */
+} stock_ver;
+
+long ver_cnt; /* versions allocated and not yet freed (atomic) */
+
+#define NODE_IDLE  0
+#define NODE_LIST  1 /* a list is putting a delisted stock back */
+#define NODE_SWEEP 2 /* a sweep is unlinking it; never idle again */
+
+/*
+ * catalog  ϳ (skip list node). ù cache line ã   key
+ * level  , ° line ֹ  head, ֹ   ٸ
+ *  ã traversal false sharing ʴ´.
+ */
+typedef struct stock_node {
+    sl_node sl; /* key = stock ID; first, the skip list casts to it */
+    int state; /* NODE_* (atomic) */
+    int row_len; /* row as show rendered it last; -1 = too long to keep (show.mutex) */
+    char row[32];
+    stock_ver* head __attribute__((aligned(STOCK_LINE))); /* newest version (atomic) */
+    int pruning; /* a writer is freeing old versions (atomic flag) */
+    int dirty; /* row may be out of date (atomic) */
+    unsigned long retired; /* stable when it was unlinked */
+    struct stock_node* free_next; /* retired stack */
+} stock_node;
+
+/*
+ * ֽ : ID  lock-free skip list ID -> node index. show list/delist
+ * skip list, ֹ index lock  о buy/sell  ã O(1)̴.
+ * index ġ list sweep index_mutex ´.  catalog д 
+ * snap reservation  ־ ׵  node ٲ index  ʴ´.
+ */
+struct {
+    skiplist list;
+    idtab* index; /* node per ID, for orders (atomic pointer) */
+    idtab* old_index; /* replaced by a grown copy, freed like retired nodes (index_mutex) */
+    long index_slots; /* (atomic) */
+    sem_t index_mutex; /* index writers: list and catalog_sweep */
+    long listed; /* stocks trading (atomic) */
+    long gone; /* delisted but still linked, for catalog_sweep (atomic) */
+    stock_node* retired; /* unlinked, freed once no reservation can reach them (atomic stack) */
+    int reaping; /* a sweep is freeing retired nodes (atomic flag) */
+} catalog;
+
+#define STOCK_FILE "stock.txt"
+#define STOCK_TMP  "stock.txt.tmp" /* written whole, then renamed over STOCK_FILE */
+
+sem_t file_mutex; /* stock.txt ⸦ ȣѴ:    thread STOCK_TMP  */
+
+void read_stock(void); /* stock.txt о catalog  */
+void write_stock(void); /*  ֽ ¸ stock.txt  */
+stock_node* stock_find(int id); /* id node,  NULL; reservation ȿ */
+stock_node* catalog_find(int id); /* stock_find on the skip list: list/delist */
+int stock_order(int id, int op, int n); /* ORDER_OK, ORDER_SHORT or ORDER_NOSTOCK */
+void list_stock(int id, int left, int price); /*   */
+void delist_stock(int id); /*   */
+
+/*
+ * ̸   show .   ԽõǸ ٲ ʾƼ  snapshot ϴ
+ * client ״  .    dirty  ٸ ٽ sprintfϰ
+ *   node     Ѵ.
+ */
+typedef struct show_buf {
+    unsigned long ts; /* snapshot the text shows */
+    unsigned long retired; /* stable when a newer buffer replaced this one */
+    int len;
+    int fit; /* whole rows that fit in MAXLINE end here */
+    int cap;
+    char* text;
+    struct show_buf* next; /* retired list */
+} show_buf;
+
+struct {
+    show_buf* cur; /* newest buffer (atomic) */
+    show_buf* retired; /* replaced, freed once no reservation can still read them */
+    sem_t mutex; /* one renderer at a time; the others wait and share its buffer */
+    long renders, rows, shared; /* stats: buffers built, rows sprintf'd, shows served from cur */
+} show;
+
+void show_init(void); /* ó show buffer  */
+void show_stock(int connfd); /*  ֽ ¸ ش */
+void buy_stock(int connfd, int id, int num); /* ֽ  */
+void sell_stock(int connfd, int id, int num); /* ֽ Ǹ */
 void sigint_handler(int signo);
+void usage(char* prog);
 
 /***********************Լ ***********************/
 
-/* Create an empty, bounded, shared FIFO buffer with n slots */
-void sbuf_init(sbuf_t* sp, int n)
+/* Worker thread routine:   connq   óѴ */
+void* worker(void* vargp)
+{
+    int connfd;
+
+    Pthread_detach(pthread_self());
+    pin_thread("worker", (int)(long)vargp); /* before its stack and buffers are touched */
+    while ((connfd = pool_take(&workers)) >= 0) { /* Remove connfd from queue */
+        if (mode == MODE_HYBRID)
+            hybrid_serve(hconns[connfd]); /* run its buffered commands */
+        else {
+            echo_cnt(connfd); /* service client */
+            Close(connfd);
+        }
+    }
+    return NULL;
+}
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* "stats"  worker pool  */
+void show_pool(char* buf)
 {
-    sp->buf = Calloc(n, sizeof(int));
-    sp->n = n; /* Buffer holds max of n items */
-    sp->front = sp->rear = 0; /* Empty buffer iff front == rear */
-    Sem_init(&sp->mutex, 0, 1); /* Binary semaphore for locking */
-    Sem_init(&sp->slots, 0, n); /* Initially, buf has n empty slots */
-    Sem_init(&sp->items, 0, 0); /* Initially, buf has 0 items */
+    P(&workers.mutex);
+    sprintf(buf, "workers %d (min %d, max %d, peak %d, %d idle), spawned %ld, retired %ld\n"
+        "queue %d waiting, wait %.3fms avg, %.3fms max\n",
+        workers.live, workers.min, workers.max, workers.peak,
+        __atomic_load_n(&workers.idle, __ATOMIC_RELAXED), workers.spawned, workers.retired,
+        mpmc_count(&connq), __atomic_load_n(&workers.wait_avg_us, __ATOMIC_RELAXED) / 1000.0,
+        __atomic_load_n(&workers.wait_max_us, __ATOMIC_RELAXED) / 1000.0);
+    V(&workers.mutex);
 }
 
-/* Clean up buffer sp */
-void sbuf_deinit(sbuf_t* sp)
+/* conn slab:   CONN_SLAB   Ҵ free list ִ´ */
+conn* conn_alloc(void)
 {
-    Free(sp->buf);
+    conn* c;
+    int k;
+
+    P(&conn_mutex);
+    if (conn_freelist == NULL)
+    {
+        c = Malloc(CONN_SLAB * sizeof(conn));
+        conn_bytes += CONN_SLAB * sizeof(conn);
+        for (k = 0; k < CONN_SLAB; k++)
+        {
+            c[k].next = conn_freelist;
+            conn_freelist = &c[k];
+        }
+    }
+    c = conn_freelist;
+    conn_freelist = c->next;
+    conn_inuse++;
+    V(&conn_mutex);
+    return c;
 }
 
-/* Insert item onto the rear of shared buffer sp */
-void sbuf_insert(sbuf_t* sp, int item)
+void conn_release(conn* c)
 {
-    P(&sp->slots); /* Wait for available slot */
-    P(&sp->mutex); /* Lock the buffer */
-    sp->buf[(++sp->rear) % (sp->n)] = item; /* Insert the item */
-    V(&sp->mutex); /* Unlock the buffer */
-    V(&sp->items); /* Announce available item */
+    P(&conn_mutex);
+    conn_inuse--;
+    c->next = conn_freelist;
+    conn_freelist = c;
+    V(&conn_mutex);
 }
 
-/* Remove and return the first item from buffer sp */
-int sbuf_remove(sbuf_t* sp)
+/* Worker thread service routine */
+void echo_cnt(int connfd) {
+    int rc;
+    conn* c = conn_alloc(); /* rio, line buffer and timer of this connection */
+
+    c->fd = connfd;
+    c->proto = PROTO_LEGACY; /* "proto 2" switches to framed replies */
+    Rio_readinitb(&c->rio, connfd);
+    conn_timer_init(&c->timer, connfd);
+
+    while (1)
+    {
+        /* buffered bytes are the start of the next line: it gets the request timeout */
+        conn_timer(&c->timer, c->rio.rio_cnt > 0 ? TM_REQUEST : TM_IDLE);
+        if (rio_readlineb(&c->rio, c->buf, MAXLINE) <= 0)
+            break; /* EOF, or the timer shut the connection down */
+        conn_timer(&c->timer, TM_WRITE);
+
+        rc = run_command(connfd, c->buf, &c->proto);
+        if (rc != CMD_SILENT && send_reply(connfd, c->proto) < 0 && rc != CMD_EXIT)
+            break;
+        clear_printbuf();
+        if (rc == CMD_EXIT)
+            break;
+    }
+    conn_timer_del(&c->timer); /* before thread() closes connfd and the fd number is reused */
+    clear_printbuf();
+    conn_release(c);
+}
+
+/*
+ * run_command -    ϰ  printbuf غѴ.
+ * Returns CMD_REPLY, CMD_EXIT, or CMD_SILENT when nothing is to be sent
+ * (framed clients get exactly one reply per line, even an empty one).
+ */
+void log_received(int connfd, int n)
 {
-    int item;
-    P(&sp->items); /* Wait for available item */
-    P(&sp->mutex); /* Lock the buffer */
-    item = sp->buf[(++sp->front) % (sp->n)]; /* Remove the item */
-    V(&sp->mutex); /* Unlock the buffer */
-    V(&sp->slots); /* Announce available slot */
-    return item;
+    printf("thread %d received %d (%d total) bytes on fd %d\n",
+        (int)pthread_self(), n, __atomic_add_fetch(&byte_cnt, n, __ATOMIC_RELAXED), connfd);
 }
 
-/* Worker thread routine */
-void* thread(void* vargp)
+int run_command(int connfd, char* line, int* proto)
+{
+    char command[16]; command[0] = 0;
+    int id = 0; int num = 0;
+
+    sscanf(line, "%15s %d %d", command, &id, &num);
+    log_received(connfd, strlen(line));
+
+    if (strcmp(command, "show") == 0)
+        show_stock(connfd);
+    else if (strcmp(command, "buy") == 0)
+        buy_stock(connfd, id, num);
+    else if (strcmp(command, "sell") == 0)
+        sell_stock(connfd, id, num);
+    else if (strcmp(command, "list") == 0)
+    {
+        int price;
+
+        if (sscanf(line, "%*s %d %d %d", &id, &num, &price) == 3 && num >= 0)
+            list_stock(id, num, price);
+        else
+            sprintf(printbuf, "usage: list ID left price\n");
+    }
+    else if (strcmp(command, "delist") == 0)
+        delist_stock(id);
+    else if (strcmp(command, "exit") == 0)
+    {
+        sprintf(printbuf, "exit the stock server\n");
+        write_stock();
+        return CMD_EXIT;
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        char arg[16] = "";
+
+        sscanf(line, "%*s %15s", arg);
+        if (strcmp(arg, "mem") == 0)
+            show_mem();
+        else
+            show_stats();
+    }
+    else if (strcmp(command, "proto") == 0)
+    {
+        /* the acknowledgement is already sent in the new framing */
+        if (id == PROTO_LEGACY || id == PROTO_FRAMED)
+        {
+            *proto = id;
+            sprintf(printbuf, "proto %d\n", id);
+        }
+        else
+            sprintf(printbuf, "unsupported protocol\n");
+    }
+    else
+    {
+        write_stock();
+        return *proto == PROTO_FRAMED ? CMD_REPLY : CMD_SILENT;
+    }
+    return CMD_REPLY;
+}
+
+/*
+ *    printbuf .  ׻  ִ printbuf տ
+ * ̾ Ƿ strlen ڴ ̹ 0̴: legacy  padding ״ ȴ.
+ */
+void clear_printbuf(void)
+{
+    memset(printbuf, 0, strlen(printbuf));
+}
+
+/* printbuf  protocol ° connfd .   -1 */
+int send_reply(int connfd, int proto)
+{
+    char out[MAXLINE + 16];
+
+    if (proto == PROTO_LEGACY)
+        return rio_writen(connfd, printbuf, MAXLINE) < 0 ? -1 : 0; /* old clients read fixed MAXLINE blocks */
+    return rio_writen(connfd, out, format_reply(out, proto)) < 0 ? -1 : 0;
+}
+
+/* printbuf  protocol ° out(MAXLINE + 16 bytes) . ̸ ȯ */
+int format_reply(char* out, int proto)
+{
+    int len, n;
+
+    if (proto == PROTO_LEGACY)
+    {
+        memcpy(out, printbuf, MAXLINE); /* old clients read fixed MAXLINE blocks */
+        return MAXLINE;
+    }
+    len = strlen(printbuf);
+    n = sprintf(out, "%d\n", len);
+    memcpy(out + n, printbuf, len);
+    return n + len;
+}
+
+/* timer thread: tick ð踦 Խϰ wheel  deadline   shutdownѴ */
+void* timer_thread(void* vargp)
 {
     Pthread_detach(pthread_self());
+    pin_thread(NULL, -1);
     while (1) {
-        int connfd = sbuf_remove(&sbuf); /* Remove connfd from buf */
-        echo_cnt(connfd); /* service client */
+        usleep(TIMER_TICK_MS * 1000);
+        __atomic_store_n(&tm_now, now_us() / 1000, __ATOMIC_RELAXED);
+        P(&wheel_mutex);
+        tw_advance(&wheel, expire_conn, NULL);
+        V(&wheel_mutex);
+    }
+}
+
+/*
+ * timer wheel callback (wheel_mutex held): node tm_recheck   ͼ
+ *  thread   deadline .  ϵ worker
+ * read/write  EOF ƿ shutdown ϰ, close worker Ѵ.
+ * ̸ deadline tm_recheck   ʿ ٽ Ǵ. A deadline is
+ * at least tm_recheck after it was written, so a check always falls
+ * between the write and the deadline and catches it on time.
+ */
+void expire_conn(tnode* n, void* arg)
+{
+    ctimer* t = (ctimer*)n;
+    unsigned long d = __atomic_load_n(&t->deadline, __ATOMIC_RELAXED);
+    unsigned long now = __atomic_load_n(&tm_now, __ATOMIC_RELAXED);
+    int kind = d & 3;
+
+    if (d != 0 && (d >> 2) <= now)
+    {
+        printf("%s timeout on fd %d\n", kind == TM_IDLE ? "idle" :
+            kind == TM_REQUEST ? "request" : "write", n->id);
+        stats_timeout(kind);
+        shutdown(n->id, SHUT_RDWR);
+        return;
+    }
+    tw_add(&wheel, n, d != 0 && (d >> 2) - now < tm_recheck ? (d >> 2) - now : tm_recheck);
+}
+
+/* Ḷ  : node wheel ִ´ */
+void conn_timer_init(ctimer* t, int fd)
+{
+    tw_node_init(&t->node, fd);
+    t->deadline = 0;
+    if (tm_recheck == 0) /* every timeout off */
+        return;
+    P(&wheel_mutex);
+    tw_add(&wheel, &t->node, tm_recheck);
+    V(&wheel_mutex);
+}
+
+/*  timer kind timeout ٽ Ǵ. ɸ θǷ lock  deadline  */
+void conn_timer(ctimer* t, int kind)
+{
+    unsigned long d = __atomic_load_n(&t->deadline, __ATOMIC_RELAXED);
+
+    if (kind == TM_REQUEST && d != 0 && (d & 3) == TM_REQUEST)
+        return; /* request: from the first byte */
+    d = timeout[kind] == 0 ? 0 :
+        (__atomic_load_n(&tm_now, __ATOMIC_RELAXED) + timeout[kind] * 1000UL) << 2 | kind;
+    __atomic_store_n(&t->deadline, d, __ATOMIC_RELAXED);
+}
+
+void conn_timer_del(ctimer* t)
+{
+    P(&wheel_mutex);
+    tw_del(&wheel, &t->node);
+    V(&wheel_mutex);
+}
+
+/***** Hybrid mode: epoll poller + worker pool *****/
+/*
+ * The poller thread reads whatever arrives on any connection. Once a
+ * connection has a complete line its fd goes to connq and the next free
+ * worker runs every complete line buffered so far, sends the replies and
+ * re-arms the fd. A thread is only busy while there is an order to run,
+ * so a small pool serves any number of clients.
+ */
+
+/* accept  poller Ѵ */
+void hybrid_add(int connfd)
+{
+    struct epoll_event ev;
+    hconn* c;
+
+    if (connfd >= hmax)
+    {
+        fprintf(stderr, "hybrid_add error: Too many clients\n");
         Close(connfd);
+        return;
     }
+    c = Calloc(1, sizeof(hconn));
+    c->fd = connfd;
+    c->proto = PROTO_LEGACY;
+    conn_timer_init(&c->timer, connfd);
+    hconns[connfd] = c;
+    __atomic_add_fetch(&hconn_cnt, 1, __ATOMIC_RELAXED);
+    conn_timer(&c->timer, TM_IDLE);
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = connfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+        unix_error("epoll_ctl error");
 }
 
-/* echo_cnt initialization routine */
-static void init_echo_cnt(void)
+/* poller:   ְ  ῡ а, ϼ   worker ѱ */
+void hybrid_read(hconn* c)
 {
-    Sem_init(&mutex, 0, 1);
-    byte_cnt = 0;
+    ssize_t n;
+
+    if (c->inbuf == NULL)
+    {
+        c->inbuf = Malloc(MAXLINE);
+        __atomic_add_fetch(&hinbuf_cnt, 1, __ATOMIC_RELAXED);
+    }
+    while ((n = recv(c->fd, c->inbuf + c->inlen, MAXLINE - 1 - c->inlen, MSG_DONTWAIT)) < 0
+        && errno == EINTR)
+        ;
+    if (n == 0)
+        c->eof = 1;
+    else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        hybrid_close(c); /* connection reset etc. */
+        return;
+    }
+    else if (n > 0)
+        c->inlen += n;
+
+    /* a full buffer is an over-long line: it is run as is, like rio_readlineb */
+    if (c->eof || memchr(c->inbuf, '\n', c->inlen) != NULL || c->inlen == MAXLINE - 1)
+    {
+        pool_submit(&workers, c->fd); /* the worker owns c from here */
+        return;
+    }
+
+    hybrid_rearm(c);
 }
 
-/* Worker thread service routine */
-void echo_cnt(int connfd) {
-    int n;
-    char buf[MAXLINE];
-    rio_t rio;
+/* worker: ۿ ִ ϼ   ϰ  poller ش */
+void hybrid_serve(hconn* c)
+{
+    char line[MAXLINE];
+    char* nl;
+    int n, rc = CMD_REPLY;
+
+    conn_timer(&c->timer, TM_WRITE);
+    while (rc != CMD_EXIT && c->inlen > 0)
+    {
+        if ((nl = memchr(c->inbuf, '\n', c->inlen)) != NULL)
+            n = nl - c->inbuf + 1;
+        else if (c->eof || c->inlen == MAXLINE - 1)
+            n = c->inlen;
+        else
+            break; /* the rest of this line is still on its way */
+
+        memcpy(line, c->inbuf, n);
+        line[n] = 0;
+        c->inlen -= n;
+        memmove(c->inbuf, c->inbuf + n, c->inlen);
+
+        rc = run_command(c->fd, line, &c->proto);
+        if (rc != CMD_SILENT && send_reply(c->fd, c->proto) < 0)
+            rc = CMD_EXIT; /* the client is gone */
+        clear_printbuf();
+    }
 
-    static pthread_once_t once = PTHREAD_ONCE_INIT;
-    Pthread_once(&once, init_echo_cnt);
+    if (rc == CMD_EXIT || c->eof)
+        hybrid_close(c);
+    else
+        hybrid_rearm(c);
+}
 
-    Rio_readinitb(&rio, connfd);
+/*  poller ش. idle  Է ۸  ʴ´ */
+void hybrid_rearm(hconn* c)
+{
+    struct epoll_event ev;
+
+    if (c->inlen == 0 && c->inbuf != NULL)
+    {
+        Free(c->inbuf);
+        c->inbuf = NULL;
+        __atomic_sub_fetch(&hinbuf_cnt, 1, __ATOMIC_RELAXED);
+    }
+    conn_timer(&c->timer, c->inlen > 0 ? TM_REQUEST : TM_IDLE);
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = c->fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
 
-    while ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0)
+/*  (poller Ǵ worker)  ݴ´ */
+void hybrid_close(hconn* c)
+{
+    conn_timer_del(&c->timer); /* before the fd number can be reused */
+    hconns[c->fd] = NULL;
+    Close(c->fd); /* also drops it from the epoll set */
+    if (c->inbuf != NULL)
     {
-        char command[5]; command[0] = 0;
-        int id = 0; int num = 0;
-        sscanf(buf, "%s %d %d", command, &id, &num);
+        Free(c->inbuf);
+        __atomic_sub_fetch(&hinbuf_cnt, 1, __ATOMIC_RELAXED);
+    }
+    Free(c);
+    __atomic_sub_fetch(&hconn_cnt, 1, __ATOMIC_RELAXED);
+}
 
-        /* mutex protects byte_cnt */
-        P(&mutex);
-        byte_cnt += n;
-        printf("thread %d received %d (%d total) bytes on fd %d\n",
-            (int)pthread_self(), n, byte_cnt, connfd);
-        V(&mutex);
+/* poller thread (main): listenfd   ϳ epoll set ٸ */
+void hybrid_loop(int listenfd)
+{
+    struct epoll_event ev, events[HYBRID_EVENTS];
+    int i, n;
+
+    if ((epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
 
-        if (strcmp(command, "show") == 0)
+    while (1) {
+        if ((n = epoll_wait(epfd, events, HYBRID_EVENTS, -1)) < 0)
         {
-            show_stock(connfd, root);
-            Rio_writen(connfd, printbuf, MAXLINE);
-            memset(printbuf, 0, sizeof(printbuf));
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
         }
-        else if (strcmp(command, "buy") == 0)
+        for (i = 0; i < n; i++)
         {
-            buy_stock(connfd, id, num, root);
-            Rio_writen(connfd, printbuf, MAXLINE);
-            memset(printbuf, 0, sizeof(printbuf));
+            if (events[i].data.fd == listenfd)
+                accept_clients(listenfd);
+            else
+                hybrid_read(hconns[events[i].data.fd]);
         }
-        else if (strcmp(command, "sell") == 0)
+    }
+}
+
+/***** Coroutine mode: stackless sessions on a few scheduler threads *****/
+
+/* session Է ۿ ϼ  ϳ line .  0 */
+static int session_getline(session* s, char* line)
+{
+    char* nl;
+    int n;
+
+    if (s->inlen == 0)
+        return 0;
+    if ((nl = memchr(s->inbuf, '\n', s->inlen)) != NULL)
+        n = nl - s->inbuf + 1;
+    else if (s->eof || s->inlen == MAXLINE - 1)
+        n = s->inlen; /* last line without '\n', or an over-long one */
+    else
+        return 0;
+
+    memcpy(line, s->inbuf, n);
+    line[n] = 0;
+    s->inlen -= n;
+    memmove(s->inbuf, s->inbuf + n, s->inlen);
+    return n;
+}
+
+/* non-blocking recv. 1: ͳ EOF , 0:  , -1:  */
+static int session_fill(session* s)
+{
+    ssize_t n;
+
+    if (s->inbuf == NULL)
+    {
+        s->inbuf = Malloc(MAXLINE);
+        __atomic_add_fetch(&sinbuf_cnt, 1, __ATOMIC_RELAXED);
+    }
+    while ((n = recv(s->fd, s->inbuf + s->inlen, MAXLINE - 1 - s->inlen, 0)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if (n == 0)
+        s->eof = 1;
+    s->inlen += n;
+    return 1;
+}
+
+/* idle session Է ۸  ʴ´ */
+static void session_idle(session* s)
+{
+    if (s->inlen == 0 && s->inbuf != NULL)
+    {
+        Free(s->inbuf);
+        s->inbuf = NULL;
+        __atomic_sub_fetch(&sinbuf_cnt, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* printbuf  .      s->out  */
+static int session_reply(session* s)
+{
+    char out[MAXLINE + 16];
+    int len = format_reply(out, s->proto);
+    ssize_t n;
+
+    while ((n = send(s->fd, out, len, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+    if (n < 0)
+        n = 0;
+    if (n < len)
+    {
+        s->out = Malloc(len - n);
+        memcpy(s->out, out + n, len - n);
+        s->outlen = len - n;
+        s->outoff = 0;
+    }
+    return 0;
+}
+
+/* s->out   .   ۸ ´ */
+static int session_flush(session* s)
+{
+    ssize_t n;
+
+    while ((n = send(s->fd, s->out + s->outoff, s->outlen - s->outoff, MSG_NOSIGNAL)) < 0
+        && errno == EINTR)
+        ;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    s->outoff += n;
+    if (s->outoff == s->outlen)
+    {
+        Free(s->out);
+        s->out = NULL;
+        s->outlen = s->outoff = 0;
+    }
+    return 0;
+}
+
+static __thread coro_sched* cur_sched; /* the scheduler this thread runs */
+
+/* shard mode: buy/sell ̸ ֹ s ä 1 */
+static int order_parse(session* s, char* line)
+{
+    char command[16]; command[0] = 0;
+
+    s->id = s->num = 0;
+    sscanf(line, "%15s %d %d", command, &s->id, &s->num);
+    if (strcmp(command, "buy") == 0)
+        s->op = OP_BUY;
+    else if (strcmp(command, "sell") == 0)
+        s->op = OP_SELL;
+    else
+        return 0;
+    log_received(s->fd, strlen(line));
+    return 1;
+}
+
+/* shard   buy_stock/sell_stock    */
+static int order_reply(session* s)
+{
+    if (s->num == ORDER_NOSTOCK)
+        sprintf(printbuf, "No such stock\n");
+    else if (s->num == ORDER_SHORT)
+        sprintf(printbuf, "Not enough left stock\n");
+    else
+        sprintf(printbuf, s->op == OP_BUY ? "[buy] success\n" : "[sell] success\n");
+    return CMD_REPLY;
+}
+
+/*
+ * session_run -  ϳ   (coroutine). echo_cnt  帧
+ *  غ ʾ CO_AWAIT scheduler ư, غǸ  ڸ
+ * ̾ ȴ. Locals do not survive a CO_AWAIT; line is only used
+ * between two of them.
+ */
+int session_run(session* s)
+{
+    char line[MAXLINE];
+    int rc;
+
+    CO_BEGIN(&s->co);
+    while (1)
+    {
+        /* ϼ    д´ */
+        while (session_getline(s, line) == 0)
         {
-            sell_stock(connfd, id, num, root);
-            Rio_writen(connfd, printbuf, MAXLINE);
-            memset(printbuf, 0, sizeof(printbuf));
+            if (s->eof)
+                CO_EXIT(&s->co);
+            if ((rc = session_fill(s)) < 0)
+                CO_EXIT(&s->co); /* connection reset, or the timer shut it down */
+            if (rc == 0)
+            {
+                session_idle(s);
+                conn_timer(&s->timer, s->inlen > 0 ? TM_REQUEST : TM_IDLE);
+                CO_AWAIT(&s->co, CO_READ);
+            }
         }
-        else if (strcmp(command, "exit") == 0)
+
+        conn_timer(&s->timer, TM_WRITE);
+        if (nshards > 0 && order_parse(s, line))
         {
-            sprintf(printbuf, "exit the stock server\n");
-            //printf("printbuf:: %s\n", printbuf); /*ӽ*/
-            Rio_writen(connfd, printbuf, MAXLINE);
-            memset(printbuf, 0, sizeof(printbuf));
-            write_stock(root);
-            break;
+            shard_send(cur_sched, s);
+            CO_AWAIT(&s->co, CO_CALL); /* until the owning shard answers */
+            s->rc = order_reply(s);
         }
         else
+            s->rc = run_command(s->fd, line, &s->proto);
+        if (s->rc != CMD_SILENT && session_reply(s) < 0)
+            s->rc = CMD_EXIT;
+        clear_printbuf(); /* printbuf belongs to the thread, not to this session */
+
+        while (s->out != NULL) /*  client:     ٸ */
         {
-            write_stock(root);
+            CO_AWAIT(&s->co, CO_WRITE);
+            if (session_flush(s) < 0)
+                CO_EXIT(&s->co);
         }
-        memset(printbuf, 0, sizeof(printbuf));
-        // write_stock(root);
+        if (s->rc == CMD_EXIT)
+            CO_EXIT(&s->co);
     }
+    CO_END(&s->co);
 }
 
-void show_stock(int connfd, node_pointer root)
+/* accept  scheduler ϳ round-robin ñ */
+void coro_add(int connfd)
 {
-    char tmpbuf[MAXLINE];
-    if (root != NULL)
-    {
-        show_stock(connfd, root->left_child);
+    static int next;
+    struct epoll_event ev;
+    session* s = Calloc(1, sizeof(session));
+
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+    CO_INIT(&s->co);
+    s->fd = connfd;
+    s->proto = PROTO_LEGACY;
+    s->wait = CO_READ;
+    conn_timer_init(&s->timer, connfd);
+    __atomic_add_fetch(&session_cnt, 1, __ATOMIC_RELAXED);
+    conn_timer(&s->timer, TM_IDLE);
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET; /* once: session_ready filters by s->wait */
+    ev.data.ptr = s;
+    if (epoll_ctl(scheds[next].epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    next = (next + 1) % nscheds;
+}
 
-        P(&root->stock.mutex);
-        root->stock.readcnt++;
-        if (root->stock.readcnt == 1) //first in reader
-            P(&root->stock.w);
-        V(&root->stock.mutex);
+void session_close(session* s)
+{
+    conn_timer_del(&s->timer); /* before the fd number can be reused */
+    Close(s->fd); /* also drops it from the epoll set */
+    s->inlen = 0;
+    session_idle(s);
+    if (s->out != NULL)
+        Free(s->out);
+    Free(s);
+    __atomic_sub_fetch(&session_cnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * fd edge-triggered б   ϵǾ ִ. session recv/send
+ * EAGAIN  ڿ CO_READ/CO_WRITE ٸǷ edge ġ ʰ,
+ * ٸ ʴ  event CO_CALL  event  ȴ.
+ */
+static int session_ready(session* s, unsigned int events)
+{
+    if (s->wait == CO_READ)
+        return (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+    if (s->wait == CO_WRITE)
+        return (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0;
+    return 0;
+}
 
-        // Writing
-        sprintf(tmpbuf, "%d %d %d\n", root->stock.ID, root->stock.left_stock, root->stock.price);
-        strcat(printbuf, tmpbuf);
+static void sched_resume(session* s)
+{
+    if ((s->wait = session_run(s)) == CO_DONE)
+        session_close(s);
+}
 
-        P(&root->stock.mutex);
-        root->stock.readcnt--;
-        if (root->stock.readcnt == 0) //last out reader
-            V(&root->stock.w);
-        V(&root->stock.mutex);
+/* scheduler thread: غ fd session shard  session ̾ Ѵ */
+void* sched_thread(void* vargp)
+{
+    coro_sched* sc = vargp;
+    struct epoll_event events[HYBRID_EVENTS];
+    int i, n, replies;
 
-        show_stock(connfd, root->right_child);
+    Pthread_detach(pthread_self());
+    pin_thread("scheduler", sc->idx);
+    cur_sched = sc;
+    while (1) {
+        if ((n = epoll_wait(sc->epfd, events, HYBRID_EVENTS, -1)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        replies = 0;
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == sc)
+                replies = 1;
+            else if (session_ready(events[i].data.ptr, events[i].events))
+                sched_resume(events[i].data.ptr);
+        }
+        /* after the batch: a reply may finish a session that still has an event in it */
+        if (replies)
+            sched_replies(sc);
+        if (nshards > 0)
+            sched_flush(sc);
     }
+    return NULL;
 }
 
-struct node* tree_search(node_pointer root, int id) {
-    if (root == NULL || root->stock.ID == id)
-        return root;
+/***** Shard mode: each stock is updated by one shard thread only *****/
+
+static void doorbell(int efd)
+{
+    uint64_t one = 1;
 
-    if (id < root->stock.ID)
-        return tree_search(root->left_child, id);
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        unix_error("eventfd write error");
+}
+
+/* scheduler doorbell channel  shard thread  */
+void shard_init(void)
+{
+    struct epoll_event ev;
+    pthread_t tid;
+    int i;
 
+    for (i = 0; i < nscheds; i++)
+    {
+        if ((scheds[i].efd = eventfd(0, EFD_NONBLOCK)) < 0)
+            unix_error("eventfd error");
+        ev.events = EPOLLIN;
+        ev.data.ptr = &scheds[i];
+        if (epoll_ctl(scheds[i].epfd, EPOLL_CTL_ADD, scheds[i].efd, &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
+    orderq = Malloc(nscheds * nshards * sizeof(spsc_t));
+    replyq = Malloc(nscheds * nshards * sizeof(spsc_t));
+    for (i = 0; i < nscheds * nshards; i++)
+    {
+        spsc_init(&orderq[i], SHARDQ_SIZE);
+        spsc_init(&replyq[i], SHARDQ_SIZE);
+    }
+    for (i = 0; i < nshards; i++)
+    {
+        shards[i].idx = i;
+        if ((shards[i].efd = eventfd(0, 0)) < 0)
+            unix_error("eventfd error");
+        Pthread_create(&tid, NULL, shard_thread, &shards[i]);
+    }
+}
+
+/* ֹ ϳ ϰ  m->num .    shard θ */
+void shard_exec(spsc_msg* m)
+{
+    m->num = stock_order(m->id, m->op, m->num);
+}
+
+/*
+ * shard thread: doorbell ︮  scheduler channel   ֹ
+ * ϰ,     scheduler . eventfd counter
+ *  ߿ ︰ doorbell  read ٷ ش.
+ */
+void* shard_thread(void* vargp)
+{
+    shard* sh = vargp;
+    spsc_msg m;
+    uint64_t v;
+    unsigned long long woke;
+    long done;
+    int j;
+
+    Pthread_detach(pthread_self());
+    pin_thread("shard", nscheds + sh->idx);
+    while (1) {
+        if (read(sh->efd, &v, sizeof(v)) < 0 && errno != EINTR)
+            unix_error("eventfd read error");
+        do {
+            woke = 0;
+            done = 0;
+            for (j = 0; j < nscheds; j++)
+                while (spsc_try_pop(&orderq[j * nshards + sh->idx], &m) == 0)
+                {
+                    shard_exec(&m);
+                    while (spsc_try_push(&replyq[sh->idx * nscheds + j], &m) < 0)
+                    {
+                        doorbell(scheds[j].efd); /* it drains replies without waiting on us */
+                        sched_yield();
+                    }
+                    woke |= 1ULL << j;
+                    done++;
+                }
+            for (j = 0; j < nscheds; j++)
+                if (woke & (1ULL << j))
+                    doorbell(scheds[j].efd);
+            __atomic_add_fetch(&sh->orders, done, __ATOMIC_RELAXED);
+        } while (done > 0);
+    }
+    return NULL;
+}
+
+static int order_push(coro_sched* sc, session* s)
+{
+    int k = (unsigned int)s->id % nshards;
+    spsc_msg m = { s, s->op, s->id, s->num };
+
+    if (spsc_try_push(&orderq[sc->idx * nshards + k], &m) < 0)
+        return -1;
+    sc->ring |= 1ULL << k;
+    return 0;
+}
+
+/* ֹ  shard channel ִ´.  á backlog ʸ ٸ */
+void shard_send(coro_sched* sc, session* s)
+{
+    s->next = NULL;
+    if (sc->backlog == NULL && order_push(sc, s) == 0)
+        return;
+    if (sc->backlog == NULL)
+        sc->backlog = s;
     else
-        return tree_search(root->right_child, id);
+        sc->backlog_tail->next = s;
+    sc->backlog_tail = s;
+}
+
+/* backlog channel ű, ̹  ֹ  shard doorbell   ︰ */
+void sched_flush(coro_sched* sc)
+{
+    int k;
+
+    while (sc->backlog != NULL && order_push(sc, sc->backlog) == 0)
+        sc->backlog = sc->backlog->next;
+    for (k = 0; k < nshards; k++)
+        if (sc->ring & (1ULL << k))
+            doorbell(shards[k].efd);
+    sc->ring = 0;
 }
 
-void buy_stock(int connfd, int id, int n, node_pointer root)
+/* shard   session ְ ٸ ڸ ̾ Ѵ */
+void sched_replies(coro_sched* sc)
 {
-    if (root == NULL) return;
+    spsc_msg m;
+    uint64_t v;
+    session* s;
+    int k;
+
+    if (read(sc->efd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    for (k = 0; k < nshards; k++)
+        while (spsc_try_pop(&replyq[k * nscheds + sc->idx], &m) == 0)
+        {
+            s = m.tag;
+            s->num = m.num;
+            sched_resume(s);
+        }
+}
 
-    node_pointer target = tree_search(root, id);
+/* fd ã ǥ ũ(ִ  ): RLIMIT_NOFILE hard limit ÷ Ѵ */
+int default_maxconn(void)
+{
+    struct rlimit rl;
 
-    if (target->stock.left_stock < n)
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return FD_SETSIZE;
+    if (rl.rlim_cur < rl.rlim_max)
     {
-        sprintf(printbuf, "Not enough left stock\n");
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > MAXCONN_HYBRID)
+        return MAXCONN_HYBRID;
+    return (int)rl.rlim_cur;
+}
+
+double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void init_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.start = stats.win_start = now_sec();
+    Sem_init(&stats.mutex, 0, 1);
+}
+
+/* window  ֱ accept rate Ѵ. stats.mutex  ȣ */
+static void stats_roll(double now)
+{
+    if (now - stats.win_start < STATS_WINDOW)
+        return;
+    stats.win_rate = stats.win_cnt / (now - stats.win_start);
+    stats.win_start = now;
+    stats.win_cnt = 0;
+}
+
+/*  ϳ acceptߴ. batch = ̹ readiness event   */
+void stats_accepted(int batch)
+{
+    double now = now_sec();
+
+    P(&stats.mutex);
+    stats.accepted++;
+    stats.win_cnt++;
+    if (batch > stats.maxbatch)
+        stats.maxbatch = batch;
+    stats_roll(now);
+    V(&stats.mutex);
+}
+
+/* "stats" :  踦 printbuf  */
+void show_stats(void)
+{
+    double now = now_sec();
+
+    P(&stats.mutex);
+    stats_roll(now);
+    sprintf(printbuf, "accepted %ld conns in %.1fs (%.1f/s avg, %.1f/s last window, max batch %ld)\n"
+        "timed out %ld idle, %ld request, %ld write\n",
+        stats.accepted, now - stats.start, stats.accepted / (now - stats.start),
+        stats.win_rate, stats.maxbatch,
+        stats.timeouts[TM_IDLE], stats.timeouts[TM_REQUEST], stats.timeouts[TM_WRITE]);
+    V(&stats.mutex);
+    if (mode != MODE_CORO) /* no worker pool: schedulers run the sessions */
+        show_pool(printbuf + strlen(printbuf));
+    if (nshards > 0)
+    {
+        int k;
+
+        strcat(printbuf, "shard orders");
+        for (k = 0; k < nshards; k++)
+            sprintf(printbuf + strlen(printbuf), " %ld", __atomic_load_n(&shards[k].orders, __ATOMIC_RELAXED));
+        strcat(printbuf, "\n");
+    }
+    sprintf(printbuf + strlen(printbuf), "snapshot at %lu, %ld stock versions live\n",
+        snap_stable(), __atomic_load_n(&ver_cnt, __ATOMIC_RELAXED));
+    sprintf(printbuf + strlen(printbuf), "catalog %ld listed, %ld delisted awaiting removal, index %ld slots\n",
+        __atomic_load_n(&catalog.listed, __ATOMIC_RELAXED), __atomic_load_n(&catalog.gone, __ATOMIC_RELAXED),
+        __atomic_load_n(&catalog.index_slots, __ATOMIC_RELAXED));
+    sprintf(printbuf + strlen(printbuf), "show cache: %ld renders (%ld rows), %ld shared\n",
+        __atomic_load_n(&show.renders, __ATOMIC_RELAXED), __atomic_load_n(&show.rows, __ATOMIC_RELAXED),
+        __atomic_load_n(&show.shared, __ATOMIC_RELAXED));
+}
+
+/*
+ * "stats mem" : worker conn ϳ(rio ۿ   )  Ƿ
+ *  ޸𸮴   ƴ϶ worker  δ.
+ */
+void show_mem(void)
+{
+    if (mode == MODE_CORO)
+    {
+        sprintf(printbuf, "sessions %ld on %d schedulers, %d bytes each, input buffers %ld in use (%d bytes each)\n",
+            __atomic_load_n(&session_cnt, __ATOMIC_RELAXED), nscheds, (int)sizeof(session),
+            __atomic_load_n(&sinbuf_cnt, __ATOMIC_RELAXED), MAXLINE);
+        return;
+    }
+    if (mode == MODE_HYBRID)
+    {
+        sprintf(printbuf, "conns %ld on %d workers, %d bytes each, input buffers %ld in use (%d bytes each)\n",
+            __atomic_load_n(&hconn_cnt, __ATOMIC_RELAXED), workers.live, (int)sizeof(hconn),
+            __atomic_load_n(&hinbuf_cnt, __ATOMIC_RELAXED), MAXLINE);
+        return;
+    }
+    P(&conn_mutex);
+    sprintf(printbuf, "conns %ld of %d workers, %d bytes each, conn slabs %ld bytes\n",
+        conn_inuse, workers.live, (int)sizeof(conn), conn_bytes);
+    V(&conn_mutex);
+}
+
+void stats_timeout(int kind)
+{
+    P(&stats.mutex);
+    stats.timeouts[kind]++;
+    V(&stats.mutex);
+}
+
+/*
+ * accept_clients - listen backlog   EAGAIN    ޾
+ * connq ִ´. Peer names are logged numerically, after the connection is
+ * already queued, so a slow resolver never holds up the workers.
+ * Returns the number of connections accepted.
+ */
+int accept_clients(int listenfd)
+{
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
+    char client_hostname[NI_MAXHOST], client_port[NI_MAXSERV];
+    int connfd, n = 0;
+
+    while (1)
+    {
+        clientlen = sizeof(struct sockaddr_storage);
+        /* listenfd is non-blocking, the connected sockets are not (workers use Rio) */
+        if ((connfd = accept4(listenfd, (SA*)&clientaddr, &clientlen, 0)) < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "accept error: %s\n", strerror(errno)); /* EMFILE etc.: retry next wakeup */
+            break;
+        }
+        n++;
+        stats_accepted(n); /* counted before pool_submit, which may block */
+        if (mode == MODE_HYBRID)
+            hybrid_add(connfd);
+        else if (mode == MODE_CORO)
+            coro_add(connfd);
+        else
+            pool_submit(&workers, connfd); /* Insert connfd in queue */
+
+        if (getnameinfo((SA*)&clientaddr, clientlen, client_hostname, NI_MAXHOST,
+            client_port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+            printf("Connected to (%s, %s)\n", client_hostname, client_port);
+    }
+    return n;
+}
+
+/* snapshot ts ̴ version: ts      . ׶  ̾ NULL */
+static stock_ver* stock_at(stock_node* r, unsigned long ts)
+{
+    stock_ver* v = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    while (v != NULL && v->ts > ts)
+        v = __atomic_load_n(&v->prev, __ATOMIC_RELAXED);
+    return v;
+}
+
+/* show stock.txt   row  ̸ ȯѴ. ts    0 */
+static int stock_row(char* row, stock_node* r, unsigned long ts)
+{
+    stock_ver* v = stock_at(r, ts);
+
+    row[0] = '\0';
+    if (v == NULL || v->left_stock == STOCK_GONE)
+        return 0;
+    return sprintf(row, "%d %d %d\n", r->sl.key, v->left_stock, v->price);
+}
+
+/* b->text len + 1 byte ڸ ´ */
+static void show_alloc(show_buf* b, int len)
+{
+    if (b->cap < len + 1)
+    {
+        b->cap = len + 1 > b->cap * 2 ? len + 1 : b->cap * 2; /* grow geometrically */
+        b->text = Realloc(b->text, b->cap);
+    }
+}
+
+/*
+ * snapshot ts buffer  (show.mutex , reservation ȿ).
+ * dirty 鼭   ٸ ٽ µ, ts  ֹ dirty 
+ * ̹ snapshot  ̹Ƿ dirty ٽ Ѽ  buffer ѱ.
+ * Writers set a stock's flag before reporting its timestamp done, so every
+ * change at or below ts has its flag visible here.
+ */
+static show_buf* show_render(unsigned long ts)
+{
+    show_buf *old = show.cur, *b = NULL, **pp, *q;
+    stock_node* r;
+    unsigned long h = snap_horizon();
+    char row[64];
+    int n, len = 0;
+
+    for (pp = &show.retired; (q = *pp) != NULL;) /* free what no reader can still hold */
+    {
+        if (q->retired < h)
+        {
+            *pp = q->next;
+            if (b == NULL)
+                b = q; /* reuse one */
+            else
+            {
+                Free(q->text);
+                Free(q);
+            }
+        }
+        else
+            pp = &q->next;
+    }
+    if (b == NULL)
+        b = Calloc(1, sizeof(show_buf));
+    show_alloc(b, old != NULL ? old->len : 64);
+    b->fit = 0;
+
+    for (r = (stock_node*)sl_first(&catalog.list); r != NULL; r = (stock_node*)sl_next(&r->sl))
+    {
+        if (__atomic_exchange_n(&r->dirty, 0, __ATOMIC_ACQ_REL) || r->row_len < 0)
+        {
+            n = stock_row(row, r, ts);
+            show.rows++;
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE)->ts > ts)
+                __atomic_store_n(&r->dirty, 1, __ATOMIC_RELAXED);
+            if (n < (int)sizeof(r->row))
+            {
+                memcpy(r->row, row, n);
+                r->row_len = n;
+            }
+            else
+                r->row_len = -1;
+        }
+        else
+            memcpy(row, r->row, n = r->row_len);
+        show_alloc(b, len + n);
+        memcpy(b->text + len, row, n);
+        len += n;
+        if (len < MAXLINE)
+            b->fit = len;
+    }
+    b->text[len] = '\0';
+    b->len = len;
+    b->ts = ts;
+    __atomic_store_n(&show.cur, b, __ATOMIC_SEQ_CST);
+    if (old != NULL)
+    {
+        old->retired = snap_stable(); /* any reader that loaded old announced at or below this */
+        old->next = show.retired;
+        show.retired = old;
+    }
+    show.renders++;
+    return b;
+}
+
+void show_init(void)
+{
+    unsigned long ts;
+    int slot = snap_enter(&ts);
+
+    Sem_init(&show.mutex, 0, 1);
+    show_render(ts);
+    snap_exit(slot);
+}
+
+/*
+ *    (snapshot) ܷ ش. lock  ʰ writer
+ * ٸ  ,  ֹ Ϻ 񿡸 ݿ ´  ʴ´.
+ * The snapshot includes every order that finished before the show (unless
+ * a stalled writer makes snap_enter_latest settle for stable), and a
+ * buffer at least that new is shared; only when there is none does one
+ * client render, under show.mutex, while the rest wait and reuse it.
+ * A reply is cut at the last whole row that fits in MAXLINE.
+ */
+void show_stock(int connfd)
+{
+    unsigned long ts;
+    int slot = snap_enter_latest(&ts);
+    show_buf* b = __atomic_load_n(&show.cur, __ATOMIC_SEQ_CST);
+
+    if (b->ts < ts)
+    {
+        P(&show.mutex);
+        b = show.cur;
+        if (b->ts < ts)
+            b = show_render(snap_stable()); /* >= ts: newer helps whoever comes next */
+        else
+            __atomic_add_fetch(&show.shared, 1, __ATOMIC_RELAXED);
+        V(&show.mutex);
+    }
+    else
+        __atomic_add_fetch(&show.shared, 1, __ATOMIC_RELAXED);
+
+    memcpy(printbuf, b->text, b->fit);
+    printbuf[b->fit] = '\0';
+    snap_exit(slot);
+}
+
+/*
+ *  snapshot    version : horizon  version 
+ *   ͺ  .    writer , ٻڸ  writer ñ.
+ * The caller holds a reservation, so the versions it walks stay allocated.
+ */
+static void stock_prune(stock_node* r)
+{
+    stock_ver *v, *old, *next;
+    unsigned long h;
+
+    if (__atomic_exchange_n(&r->pruning, 1, __ATOMIC_ACQUIRE))
+        return;
+    h = snap_horizon();
+    for (v = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE); v != NULL && v->ts > h; v = v->prev)
+        ;
+    if (v != NULL && (old = v->prev) != NULL)
+    {
+        __atomic_store_n(&v->prev, NULL, __ATOMIC_RELAXED); /* readers stop at v: v->ts <= their snapshot */
+        for (; old != NULL; old = next)
+        {
+            next = old->prev;
+            Free(old);
+            __atomic_sub_fetch(&ver_cnt, 1, __ATOMIC_RELAXED);
+        }
     }
+    __atomic_store_n(&r->pruning, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * v *h  Ǵ. ϸ *h  head. ϸ show   ٽ ׸
+ * dirty Ѵµ, snap_done ̶ ts  snapshot ׸ show ݵ .
+ */
+static int stock_push(stock_node* r, stock_ver** h, stock_ver* v)
+{
+    unsigned long ts;
+    int ok;
+
+    v->prev = *h;
+    v->ts = ts = snap_tick();
+    ok = __atomic_compare_exchange_n(&r->head, h, v, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+    if (ok)
+        __atomic_store_n(&r->dirty, 1, __ATOMIC_RELEASE);
+    snap_done(ts); /* failed attempts too: stable must not wait for them */
+    return ok;
+}
+
+/*
+ * ֹ ϳ  version Ǵ. ܷ Ȯΰ Խð CAS  ̶  ̿
+ * ٸ ֹ   head ٽ ȮϹǷ, ÿ 絵   ʴ´.
+ * Every attempt takes its own timestamp after reading the head, so a
+ * stock's versions are in timestamp order.
+ */
+int stock_order(int id, int op, int n)
+{
+    stock_node* r;
+    stock_ver *h, *v = NULL;
+    unsigned long snap;
+    int rc = ORDER_OK, slot = snap_enter(&snap); /* keeps r and h allocated while we read them */
+
+    if ((r = stock_find(id)) == NULL)
+        rc = ORDER_NOSTOCK;
     else
     {
-        P(&(target->stock.w));
-        target->stock.left_stock -= n; //writing
-        V(&(target->stock.w));
+        h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (1)
+        {
+            if (h->left_stock == STOCK_GONE)
+            {
+                rc = ORDER_NOSTOCK;
+                break;
+            }
+            if (op == OP_BUY && h->left_stock < n)
+            {
+                rc = ORDER_SHORT;
+                break;
+            }
+            if (v == NULL)
+                v = Malloc(sizeof(stock_ver));
+            v->left_stock = h->left_stock + (op == OP_BUY ? -n : n);
+            v->price = h->price;
+            if (stock_push(r, &h, v))
+                break; /* h reloaded on failure */
+        }
+    }
+    if (rc == ORDER_OK)
+    {
+        __atomic_add_fetch(&ver_cnt, 1, __ATOMIC_RELAXED);
+        stock_prune(r);
+    }
+    else if (v != NULL)
+        Free(v);
+    snap_exit(slot);
+    return rc;
+}
+
+void buy_stock(int connfd, int id, int n)
+{
+    int rc = stock_order(id, OP_BUY, n);
+
+    if (rc == ORDER_NOSTOCK)
+        sprintf(printbuf, "No such stock\n");
+    else if (rc == ORDER_SHORT)
+        sprintf(printbuf, "Not enough left stock\n");
+    else
         sprintf(printbuf, "[buy] success\n");
+}
+
+void sell_stock(int connfd, int id, int n)
+{
+    if (stock_order(id, OP_SELL, n) == ORDER_NOSTOCK)
+        sprintf(printbuf, "No such stock\n");
+    else
+        sprintf(printbuf, "[sell] success\n");
+}
+
+/*    node. ù version ts 0̴ (list  ) */
+static stock_node* stock_node_new(int id, int left, int price)
+{
+    stock_node* r = sl_alloc(sizeof(stock_node));
+
+    r->sl.key = id;
+    r->head = Calloc(1, sizeof(stock_ver));
+    r->head->left_stock = left;
+    r->head->price = price;
+    r->dirty = 1; /* never rendered */
+    __atomic_add_fetch(&ver_cnt, 1, __ATOMIC_RELAXED);
+    return r;
+}
+
+static void stock_node_free(stock_node* r)
+{
+    stock_ver *v, *prev;
+
+    for (v = r->head; v != NULL; v = prev)
+    {
+        prev = v->prev;
+        Free(v);
+        __atomic_sub_fetch(&ver_cnt, 1, __ATOMIC_RELAXED);
     }
+    sl_free(r);
 }
 
-void sell_stock(int connfd, int id, int n, node_pointer root)
+/* id node.   ų ̹  id NULL */
+stock_node* stock_find(int id)
 {
-    if (root == NULL) return;
+    return idtab_get(__atomic_load_n(&catalog.index, __ATOMIC_ACQUIRE), id);
+}
 
+/*
+ * The skip list is what list/delist and the sweep agree on. index follows
+ * it, set after a node is linked and cleared before it is retired, so
+ * stock_find can only miss a stock whose list has not answered yet, or
+ * return one whose head already says STOCK_GONE.
+ */
+stock_node* catalog_find(int id)
+{
+    return (stock_node*)sl_find(&catalog.list, id);
+}
 
-    node_pointer target = tree_search(root, id);
+/* index r Ǵ. Ŀ 纻 ϸ  table nodeó stable  д */
+static void index_put(stock_node* r)
+{
+    idtab* old;
 
-    P(&(target->stock.w));
-    target->stock.left_stock += n; //writing
-    V(&(target->stock.w));
+    P(&catalog.index_mutex);
+    if ((old = idtab_put(&catalog.index, r->sl.key, r)) != NULL)
+    {
+        old->retired = snap_stable(); /* any reader that loaded old announced at or below this */
+        old->free_next = catalog.old_index;
+        catalog.old_index = old;
+        __atomic_store_n(&catalog.index_slots, (long)catalog.index->mask + 1, __ATOMIC_RELAXED);
+    }
+    V(&catalog.index_mutex);
+}
 
-    sprintf(printbuf, "[sell] success\n");
+static void index_drop(stock_node* r)
+{
+    P(&catalog.index_mutex);
+    idtab_drop(catalog.index, r->sl.key, r);
+    V(&catalog.index_mutex);
 }
 
+static void catalog_retire(stock_node* r)
+{
+    r->free_next = __atomic_load_n(&catalog.retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&catalog.retired, &r->free_next, r, 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
 
-node_pointer create_node(item stock)
+/*
+ *   Ǿ  snapshot  ʴ  skip list ,
+ *    reservation     node . list/delist 
+ *   ֹ show ̰ ٸ ʴ´.
+ * The caller holds a reservation, so nodes unlinked meanwhile stay readable.
+ */
+static void catalog_sweep(void)
 {
-    node_pointer new_node = (node_pointer)malloc(sizeof(node));
-    new_node->stock = stock;
-    new_node->left_child = new_node->right_child = NULL;
-   
-    return new_node;
+    stock_node *r, *next;
+    idtab *t, **pt;
+    stock_ver* h;
+    unsigned long hz = snap_horizon();
+    int expect;
+
+    if (__atomic_load_n(&catalog.gone, __ATOMIC_RELAXED) > 0)
+        for (r = (stock_node*)sl_first(&catalog.list); r != NULL; r = (stock_node*)sl_next(&r->sl))
+        {
+            h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            if (h->left_stock != STOCK_GONE || h->ts > hz || !__atomic_load_n(&r->sl.linked, __ATOMIC_ACQUIRE))
+                continue;
+            expect = NODE_IDLE;
+            if (!__atomic_compare_exchange_n(&r->state, &expect, NODE_SWEEP, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                continue; /* a list is bringing it back */
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != h) /* it came back before we got it */
+            {
+                __atomic_store_n(&r->state, NODE_IDLE, __ATOMIC_RELEASE);
+                continue;
+            }
+            if (sl_remove(&catalog.list, &r->sl) == 0)
+            {
+                __atomic_sub_fetch(&catalog.gone, 1, __ATOMIC_RELAXED);
+                index_drop(r); /* before the stamp: nobody finds r after it */
+                r->retired = snap_stable(); /* any reader that reached r announced at or below this */
+                catalog_retire(r);
+            }
+        }
+
+    if (__atomic_exchange_n(&catalog.reaping, 1, __ATOMIC_ACQUIRE))
+        return;
+    hz = snap_horizon();
+    for (r = __atomic_exchange_n(&catalog.retired, NULL, __ATOMIC_ACQUIRE); r != NULL; r = next)
+    {
+        next = r->free_next;
+        if (r->retired < hz)
+            stock_node_free(r);
+        else
+            catalog_retire(r);
+    }
+    P(&catalog.index_mutex);
+    for (pt = &catalog.old_index; (t = *pt) != NULL; )
+        if (t->retired < hz)
+        {
+            *pt = t->free_next;
+            idtab_free(t);
+        }
+        else
+            pt = &t->free_next;
+    V(&catalog.index_mutex);
+    __atomic_store_n(&catalog.reaping, 0, __ATOMIC_RELEASE);
 }
 
-node_pointer insert_node(node_pointer root, item stock)
+/*
+ *  ID node  ִ´. ֱ   timestamp  ڿ done
+ * ˸Ƿ ׺ ռ snapshot  ʴ´.   list 
+ * ִ ID  node  version Ǵ.
+ */
+void list_stock(int id, int left, int price)
 {
-    if (root == NULL)
-        return create_node(stock);
+    stock_node* r;
+    stock_ver *h, *v;
+    unsigned long snap, ts;
+    int expect, slot = snap_enter(&snap);
 
-    if (stock.ID < root->stock.ID)
-        root->left_child = insert_node(root->left_child, stock);
+    while (1)
+    {
+        if ((r = catalog_find(id)) == NULL)
+        {
+            r = stock_node_new(id, left, price);
+            r->head->ts = ts = snap_tick();
+            expect = sl_insert(&catalog.list, &r->sl);
+            snap_done(ts);
+            if (expect == 0)
+            {
+                index_put(r); /* orders find it from here; before we answer */
+                break;
+            }
+            stock_node_free(r); /* listed by someone else meanwhile: look again */
+            continue;
+        }
+        expect = NODE_IDLE;
+        if (!__atomic_compare_exchange_n(&r->state, &expect, NODE_LIST, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            sched_yield(); /* a sweep is unlinking it */
+            continue;
+        }
+        h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (h->left_stock != STOCK_GONE)
+        {
+            __atomic_store_n(&r->state, NODE_IDLE, __ATOMIC_RELEASE);
+            sprintf(printbuf, "Already listed\n");
+            snap_exit(slot);
+            return;
+        }
+        v = Malloc(sizeof(stock_ver));
+        v->left_stock = left;
+        v->price = price;
+        stock_push(r, &h, v); /* cannot fail: only a list moves a delisted head, and we hold r */
+        __atomic_add_fetch(&ver_cnt, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&catalog.gone, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->state, NODE_IDLE, __ATOMIC_RELEASE);
+        stock_prune(r);
+        break;
+    }
+    __atomic_add_fetch(&catalog.listed, 1, __ATOMIC_RELAXED);
+    sprintf(printbuf, "[list] success\n");
+    catalog_sweep();
+    snap_exit(slot);
+}
 
-    else if (stock.ID > root->stock.ID)
-        root->right_child = insert_node(root->right_child, stock);
+/*  version̴: ܷ  STOCK_GONE  ڷδ ֹ No such stock ޴´ */
+void delist_stock(int id)
+{
+    stock_node* r;
+    stock_ver *h, *v = NULL;
+    unsigned long snap;
+    int ok = 0, slot = snap_enter(&snap);
 
-    return root;
+    if ((r = catalog_find(id)) != NULL)
+    {
+        h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (!ok && h->left_stock != STOCK_GONE)
+        {
+            if (v == NULL)
+                v = Malloc(sizeof(stock_ver));
+            v->left_stock = STOCK_GONE;
+            v->price = h->price;
+            ok = stock_push(r, &h, v); /* h reloaded on failure */
+        }
+    }
+    if (ok)
+    {
+        __atomic_add_fetch(&ver_cnt, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&catalog.listed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&catalog.gone, 1, __ATOMIC_RELAXED);
+        stock_prune(r);
+        sprintf(printbuf, "[delist] success\n");
+    }
+    else
+    {
+        if (v != NULL)
+            Free(v);
+        sprintf(printbuf, "No such stock\n");
+    }
+    catalog_sweep();
+    snap_exit(slot);
 }
 
-node_pointer read_stock()
+/* stock.txt о catalog .  ID   ù ٸ  */
+void read_stock(void)
 {
-    node_pointer root = NULL;
-    FILE* fp = fopen("stock.txt", "r");
+    stock_node* r;
+    int id, left, price;
+    char line[100];
+    FILE* fp = fopen(STOCK_FILE, "r");
     if (fp == NULL)
     {
         fprintf(stderr, "fopen error\n");
         exit(1);
     }
 
-    char line[100];
+    sl_init(&catalog.list);
     while (fgets(line, sizeof(line), fp))
     {
-        item stock;
-        sscanf(line, "%d %d %d", &stock.ID, &stock.left_stock, &stock.price);
-        stock.readcnt = 0; 
-        sem_init(&stock.mutex, 0, 1);
-        sem_init(&stock.w, 0, 1);
-        root = insert_node(root, stock);
+        if (sscanf(line, "%d %d %d", &id, &left, &price) != 3 || left < 0)
+            continue;
+        r = stock_node_new(id, left, price); /* ts 0 */
+        if (sl_insert(&catalog.list, &r->sl) < 0)
+            stock_node_free(r);
+        else
+            catalog.listed++;
     }
-
     fclose(fp);
-    return root;
-}
-
-void write_inorder(node_pointer root, FILE* fp)
-{
-    if (root == NULL)
-        return;
 
-    write_inorder(root->left_child, fp);
-    fprintf(fp, "%d %d %d\n", root->stock.ID, root->stock.left_stock, root->stock.price);
-    write_inorder(root->right_child, fp);
+    catalog.index = idtab_new(catalog.listed); /* sized for them all: no copy below */
+    catalog.index_slots = (long)catalog.index->mask + 1;
+    Sem_init(&catalog.index_mutex, 0, 1);
+    for (r = (stock_node*)sl_first(&catalog.list); r != NULL; r = (stock_node*)sl_next(&r->sl))
+        idtab_put(&catalog.index, r->sl.key, r);
 }
 
-void write_stock(node_pointer root)
+/*
+ * Workers, pollers, coroutine shards and shutdown all flush here, so the
+ * writers take file_mutex and each writes a whole STOCK_TMP before rename
+ * swaps it in: a reader of stock.txt sees one complete snapshot, never a
+ * mix of two flushes or a half-written file.
+ */
+void write_stock(void)
 {
-    FILE* fp = fopen("stock.txt", "w");
+    FILE* fp;
+    stock_node* r;
+    unsigned long ts;
+    char row[64];
+    int slot;
+
+    P(&file_mutex);
+    fp = fopen(STOCK_TMP, "w");
     if (fp == NULL)
     {
         fprintf(stderr, "fopen error\n");
         exit(1);
     }
 
-    write_inorder(root, fp);
+    slot = snap_enter(&ts); /* the file is one point in time, like show */
+    for (r = (stock_node*)sl_first(&catalog.list); r != NULL; r = (stock_node*)sl_next(&r->sl))
+        if (stock_row(row, r, ts) > 0)
+            fputs(row, fp);
+    snap_exit(slot);
 
-    fclose(fp);
+    if (fclose(fp) != 0 || rename(STOCK_TMP, STOCK_FILE) < 0)
+    {
+        fprintf(stderr, "write_stock error: %s\n", strerror(errno));
+        exit(1);
+    }
+    V(&file_mutex);
+}
+
+/*
+ * -a cpu ־ ȣ thread Ѵ. idx < 0 cpus[0](main timer),
+ * worker idx cpus[1..] round-robin (cpu ϳ̸ cpus[0]).
+ * Memory a thread touches first after this lands on that cpu's NUMA node.
+ */
+void pin_thread(const char* who, int idx)
+{
+    int cpu;
+
+    if (ncpus == 0)
+        return;
+    cpu = idx < 0 || ncpus == 1 ? cpus[0] : cpus[1 + idx % (ncpus - 1)];
+    if (cpu_pin(cpu) < 0)
+        unix_error("cpu_pin error");
+    if (who != NULL)
+        printf("%s %d on cpu %d (node %d)\n", who, idx, cpu, cpu_node(cpu));
 }
 
 void sigint_handler(int signo) 
 { 
-    write_stock(root);
+    write_stock();
     printf("\nSIGINT detected\n");
     exit(1);
 }
+void usage(char* prog)
+{
+    fprintf(stderr, "usage: %s <port> [-m thread|hybrid|coro] [-n min[,max]] [-t idle[,request[,write]]]\n"
+        "       [-a cpulist] [-s nshards]\n", prog);
+    exit(0);
+}
+
 /**********************************************************/
 int main(int argc, char** argv)
 {
     Signal(SIGINT, sigint_handler);
+    Signal(SIGPIPE, SIG_IGN); /* a client closing mid-reply must not kill the server */
 
-    int i, listenfd, connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
-    char client_hostname[MAXLINE], client_port[MAXLINE];
+    int i, opt, listenfd, pmin = 0, pmax = 0;
+    struct pollfd pfd;
     pthread_t tid;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(0);
+    while ((opt = getopt(argc, argv, "a:m:n:s:t:")) != -1) {
+        switch (opt) {
+        case 'a':
+            if ((ncpus = cpu_list_parse(optarg, cpus, CPU_LIST_MAX)) < 0)
+                usage(argv[0]);
+            break;
+        case 'm':
+            if (strcmp(optarg, "thread") == 0)
+                mode = MODE_THREAD;
+            else if (strcmp(optarg, "hybrid") == 0)
+                mode = MODE_HYBRID;
+            else if (strcmp(optarg, "coro") == 0)
+                mode = MODE_CORO;
+            else
+                usage(argv[0]);
+            break;
+        case 'n':
+            if (sscanf(optarg, "%d,%d", &pmin, &pmax) < 1 || pmin <= 0)
+                usage(argv[0]);
+            break;
+        case 's':
+            if ((nshards = atoi(optarg)) <= 0 || nshards > SHARD_MAX)
+                usage(argv[0]);
+            break;
+        case 't':
+            if (sscanf(optarg, "%d,%d,%d", &timeout[TM_IDLE], &timeout[TM_REQUEST],
+                &timeout[TM_WRITE]) < 1 || timeout[TM_IDLE] < 0 ||
+                timeout[TM_REQUEST] < 0 || timeout[TM_WRITE] < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (optind != argc - 1 || (nshards > 0 && mode != MODE_CORO)) /* shards answer schedulers only */
+        usage(argv[0]);
+
+    pin_thread(NULL, -1); /* accept/poller: the catalog is first touched on cpus[0]'s node */
+    snap_init();
+    Sem_init(&file_mutex, 0, 1);
+    read_stock();
+    show_init();
+
+    listenfd = Open_listenfd(argv[optind]);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    mpmc_init(&connq, mode == MODE_HYBRID ? JOBQ_SIZE : CONNQ_SIZE);
+    init_stats();
+    tw_init(&wheel, TIMER_TICK_MS);
+    Sem_init(&wheel_mutex, 0, 1);
+    tm_now = now_us() / 1000;
+    for (i = 0; i < 3; i++)
+        if (timeout[i] > 0 && (tm_recheck == 0 || timeout[i] * 1000U < tm_recheck))
+            tm_recheck = timeout[i] * 1000U;
+    Sem_init(&conn_mutex, 0, 1);
+
+    hmax = default_maxconn();
+    if (mode == MODE_HYBRID)
+        hconns = Calloc(hmax, sizeof(hconn*));
+
+    if (mode == MODE_CORO) /* -n: scheduler threads instead of a worker pool */
+    {
+        nscheds = pmin == 0 ? 1 : pmin < CORO_MAXSCHED ? pmin : CORO_MAXSCHED;
+        for (i = 0; i < nscheds; i++)
+        {
+            if ((scheds[i].epfd = epoll_create1(0)) < 0)
+                unix_error("epoll_create1 error");
+            scheds[i].idx = i;
+        }
+        if (nshards > 0)
+            shard_init(); /* channels first: schedulers send on them */
+        for (i = 0; i < nscheds; i++)
+            Pthread_create(&tid, NULL, sched_thread, &scheds[i]);
+    }
+    else
+    {
+        if (pmin == 0)
+            pmin = mode == MODE_HYBRID ? HYBRID_MIN : NTHREADS_MIN;
+        if (pmax == 0)
+            pmax = mode == MODE_HYBRID ? HYBRID_MAX : NTHREADS_MAX;
+        if (pmax < pmin)
+            pmax = pmin;
+        pool_init(&workers, &connq, worker, pmin, pmax, hmax); /* Create worker threads */
+    }
+    Pthread_create(&tid, NULL, timer_thread, NULL);
 
-    root = read_stock();
-
-    listenfd = Open_listenfd(argv[1]);
-    sbuf_init(&sbuf, SBUFSIZE);
-
-    for (i = 0; i < NTHREADS; i++) /* Create worker threads */
-        Pthread_create(&tid, NULL, thread, NULL);
+    if (mode == MODE_HYBRID)
+        hybrid_loop(listenfd); /* does not return */
 
+    pfd.fd = listenfd;
+    pfd.events = POLLIN;
     while (1) {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
-        sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
-
-        Getnameinfo((SA*)&clientaddr, clientlen, client_hostname, MAXLINE,
-            client_port, MAXLINE, 0);
-        printf("Connected to (%s, %s)\n", client_hostname, client_port);
+        /* listenfd غǸ backlog    */
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            unix_error("poll error");
+        accept_clients(listenfd);
     }
 
-    write_stock(root);
+    write_stock();
 
     exit(0);
 }
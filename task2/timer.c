@@ -0,0 +1,109 @@
+/*
+ * timer.c - hashed timing wheel for connection timeouts
+ */
+#include <stddef.h>
+#include <time.h>
+#include "timer.h"
+
+static long long clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void tw_init(twheel *tw, unsigned tick_ms)
+{
+    int i;
+
+    for (i = 0; i < TW_SLOTS; i++)
+        tw->slots[i].prev = tw->slots[i].next = &tw->slots[i];
+    tw->now = 0;
+    tw->tick_ms = tick_ms;
+    tw->base_ms = clock_ms();
+    tw->count = 0;
+}
+
+void tw_node_init(tnode *t, int id)
+{
+    t->prev = t->next = NULL;
+    t->expire = 0;
+    t->kind = 0;
+    t->id = id;
+}
+
+int tw_armed(const tnode *t)
+{
+    return t->next != NULL;
+}
+
+void tw_del(twheel *tw, tnode *t)
+{
+    if (t->next == NULL)
+        return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    tw->count--;
+}
+
+void tw_add(twheel *tw, tnode *t, unsigned ms)
+{
+    unsigned long cur, ticks;
+    tnode *head;
+
+    tw_del(tw, t);
+    if (ms == 0)
+        return;
+
+    /* the wheel is not advanced while nothing is armed, so read the clock */
+    cur = (unsigned long)((clock_ms() - tw->base_ms) / tw->tick_ms);
+    if (cur < tw->now)
+        cur = tw->now;
+    ticks = (ms + tw->tick_ms - 1) / tw->tick_ms;
+    t->expire = cur + (ticks ? ticks : 1);
+    head = &tw->slots[t->expire & (TW_SLOTS - 1)];
+
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    tw->count++;
+}
+
+int tw_advance(twheel *tw, void (*fn)(tnode *t, void *arg), void *arg)
+{
+    unsigned long from, target, k, steps;
+    tnode *head, *t, *next;
+    int fired = 0;
+
+    target = (unsigned long)((clock_ms() - tw->base_ms) / tw->tick_ms);
+    if (target <= tw->now)
+        return 0;
+
+    /* after a long stall every bucket is visited once; expire decides */
+    from = tw->now;
+    steps = target - from;
+    if (steps > TW_SLOTS)
+        steps = TW_SLOTS;
+    tw->now = target;               /* timers re-armed by fn land past target */
+
+    for (k = 1; k <= steps && tw->count > 0; k++) {
+        head = &tw->slots[(from + k) & (TW_SLOTS - 1)];
+        for (t = head->next; t != head; t = next) {
+            next = t->next;
+            if (t->expire > target)
+                continue;           /* a later revolution */
+            tw_del(tw, t);
+            fn(t, arg);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+int tw_timeout(const twheel *tw)
+{
+    return tw->count > 0 ? (int)tw->tick_ms : -1;
+}
@@ -0,0 +1,46 @@
+/*
+ * timer.h - hashed timing wheel for connection timeouts
+ *
+ * O(1) add/delete; each tick only visits one bucket. Timers further out
+ * than one revolution stay in their bucket until their tick comes round.
+ * Not thread-safe: callers serialize access to a wheel.
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#define TW_SLOTS 1024 /* buckets, power of two */
+
+typedef struct tnode {
+    struct tnode *prev, *next; /* NULL when not armed */
+    unsigned long expire;      /* absolute tick */
+    int kind;                  /* caller-defined (TM_IDLE, ...) */
+    int id;                    /* caller-defined (slot, fd, ...) */
+} tnode;
+
+typedef struct {
+    tnode slots[TW_SLOTS];     /* list heads */
+    unsigned long now;         /* last tick processed */
+    unsigned tick_ms;
+    long long base_ms;         /* clock at tick 0 */
+    int count;                 /* armed timers */
+} twheel;
+
+void tw_init(twheel *tw, unsigned tick_ms);
+void tw_node_init(tnode *t, int id);
+int tw_armed(const tnode *t);
+
+/* (Re)arm t to fire ms milliseconds from now; ms == 0 just disarms it */
+void tw_add(twheel *tw, tnode *t, unsigned ms);
+void tw_del(twheel *tw, tnode *t);
+
+/*
+ * Advance the wheel to the current time and call fn for every expired
+ * timer. Each timer is disarmed before fn sees it, so fn may re-arm or
+ * free it. Returns the number of timers fired.
+ */
+int tw_advance(twheel *tw, void (*fn)(tnode *t, void *arg), void *arg);
+
+/* Poll timeout for the event loop: -1 with no timers armed, else one tick */
+int tw_timeout(const twheel *tw);
+
+#endif /* __TIMER_H__ */